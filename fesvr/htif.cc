@@ -197,6 +197,13 @@ void htif_t::load_program()
   return;
 }
 
+void htif_t::set_program_addresses(reg_t entry, addr_t tohost_addr, addr_t fromhost_addr)
+{
+  this->entry = entry;
+  this->tohost_addr = tohost_addr;
+  this->fromhost_addr = fromhost_addr;
+}
+
 const char* htif_t::get_symbol(uint64_t addr)
 {
   auto it = addr2symbol.find(addr);
@@ -207,6 +214,18 @@ const char* htif_t::get_symbol(uint64_t addr)
   return it->second.c_str();
 }
 
+const char* htif_t::get_symbol(uint64_t addr, uint64_t* offset)
+{
+  auto it = addr2symbol.upper_bound(addr);
+
+  if(it == addr2symbol.begin())
+      return nullptr;
+
+  --it;
+  *offset = addr - it->first;
+  return it->second.c_str();
+}
+
 bool htif_t::should_exit() const {
   return signal_exit || exitcode.has_value();
 }
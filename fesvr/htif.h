@@ -71,6 +71,10 @@ class htif_t : public chunked_memif_t
   const std::vector<std::string>& target_args() { return targs; }
 
   reg_t get_entry_point() { return entry; }
+  // For a target whose memory already holds its program, e.g. one
+  // restored from a checkpoint, in place of what load_program() would
+  // have found in the ELF
+  void set_program_addresses(reg_t entry, addr_t tohost_addr, addr_t fromhost_addr);
 
   // indicates that the initial program load can skip writing this address
   // range to memory, because it has already been loaded through a sideband
@@ -78,6 +82,9 @@ class htif_t : public chunked_memif_t
 
   // Given an address, return symbol from addr2symbol map
   const char* get_symbol(uint64_t addr);
+  // Given an address, return the nearest symbol at or below it, and its
+  // offset from there
+  const char* get_symbol(uint64_t addr, uint64_t* offset);
 
   // Return true if the simulation should exit due to a signal,
   // or end-of-test from HTIF, or an instruction limit.
@@ -71,8 +71,8 @@ void memif_t::write(addr_t addr, size_t len, const void* bytes)
 
   // now we're aligned
   bool all_zero = len != 0;
-  for (size_t i = 0; i < len; i++)
-    all_zero &= ((const char*)bytes)[i] == 0;
+  for (size_t i = 0; i < len && all_zero; i++)
+    all_zero = ((const char*)bytes)[i] == 0;
 
   if (all_zero) {
     cmemif->clear_chunk(addr, len);
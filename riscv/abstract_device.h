@@ -11,6 +11,7 @@
 #include <vector>
 
 class sim_t;
+class checkpoint_t;
 
 class abstract_device_t {
  public:
@@ -18,6 +19,14 @@ class abstract_device_t {
   virtual bool store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
   virtual ~abstract_device_t() {}
   virtual void tick(reg_t UNUSED rtc_ticks) {}
+  // Whether load() and store() handle an access of len bytes at addr as is.
+  // The bus breaks any other access into single bytes; by default, that is
+  // anything but a naturally aligned power-of-2 size.
+  virtual bool native_access(reg_t addr, size_t len) {
+    return (len & (len - 1)) == 0 && (addr & (len - 1)) == 0;
+  }
+  // Save or restore the device's state; see checkpoint.h
+  virtual void checkpoint(checkpoint_t UNUSED &c) {}
 };
 
 // factory for devices which should show up in the DTS, and can be
@@ -0,0 +1,46 @@
+// See LICENSE for license details.
+
+#include "config.h"
+#include "bbv.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+bbv_t::bbv_t(const std::string& path, size_t interval)
+  : interval(interval)
+{
+  out = fopen(path.c_str(), "w");
+  if (!out)
+    throw std::runtime_error("could not open " + path + ": " + strerror(errno));
+}
+
+bbv_t::~bbv_t()
+{
+  // the final, partial interval
+  if (!counts.empty())
+    end_interval();
+  fclose(out);
+}
+
+void bbv_t::end_interval()
+{
+  // new blocks are numbered in order of PC, so that the ids do not depend
+  // on the order of the hash table
+  std::vector<std::pair<reg_t, uint64_t>> by_pc(counts.begin(), counts.end());
+  std::sort(by_pc.begin(), by_pc.end());
+  counts.clear();
+
+  std::vector<std::pair<size_t, uint64_t>> line;
+  for (auto [pc, n] : by_pc) {
+    if (n != 0)
+      line.emplace_back(ids.emplace(pc, ids.size() + 1).first->second, n);
+  }
+  std::sort(line.begin(), line.end());
+  fputc('T', out);
+  for (auto [id, n] : line)
+    fprintf(out, ":%zu:%" PRIu64 " ", id, n);
+  fputc('\n', out);
+}
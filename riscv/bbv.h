@@ -0,0 +1,40 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_BBV_H
+#define _RISCV_BBV_H
+
+#include "decode.h"
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+// Collects a hart's basic-block vectors for SimPoint.  At the end of each
+// interval of `interval` retired instructions, it writes a line to the
+// output, in the .bb format SimPoint reads, giving the number of
+// instructions each block retired during the interval:
+//
+//   T:<id>:<count> :<id>:<count> ...
+//
+// The blocks are those of the icache: straight-line runs named by their
+// first PC, which end at a control transfer.  Ids are numbered from 1 as
+// blocks first run, and by PC among those that first run in one interval.
+class bbv_t
+{
+public:
+  bbv_t(const std::string& path, size_t interval);
+  ~bbv_t();
+
+  const size_t interval;
+
+  // instructions retired this interval, by the PC their block starts at
+  std::unordered_map<reg_t, uint64_t> counts;
+
+  // write out the interval's counts and start the next
+  void end_interval();
+
+private:
+  FILE* out;
+  std::unordered_map<reg_t, size_t> ids;
+};
+
+#endif
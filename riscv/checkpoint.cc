@@ -0,0 +1,75 @@
+// See LICENSE for license details.
+
+#include "config.h"
+#include "checkpoint.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+static const char magic[] = "spike checkpoint";
+static const uint32_t version = 1;
+
+checkpoint_t::checkpoint_t(const std::string& path, mode_t mode)
+  : path(path), mode(mode)
+{
+  file = fopen(path.c_str(), saving() ? "wb" : "rb");
+  if (!file)
+    throw std::runtime_error("could not open checkpoint " + path + ": " + strerror(errno));
+
+  try {
+    char m[sizeof(magic)];
+    memcpy(m, magic, sizeof(m));
+    io(m);
+    if (memcmp(m, magic, sizeof(m)) != 0)
+      fail("not a checkpoint");
+    expect(version, "checkpoint version");
+  } catch (...) {
+    fclose(file);
+    throw;
+  }
+}
+
+checkpoint_t::~checkpoint_t()
+{
+  fclose(file);
+}
+
+void checkpoint_t::section(const char* name)
+{
+  std::string saved = name;
+  io(saved);
+  if (saved != name)
+    fail("expected " + std::string(name) + " state, found " + saved);
+}
+
+void checkpoint_t::bytes(void* buf, size_t len)
+{
+  if (saving()) {
+    if (fwrite(buf, 1, len, file) != len)
+      fail(strerror(errno));
+  } else {
+    // a restore reads at its own offset: the machine is built while the
+    // file is open, and the children dts.cc forks to run dtc share the
+    // file offset and may move it when they exit
+    ssize_t got = pread(fileno(file), buf, len, pos);
+    if (got < 0)
+      fail(strerror(errno));
+    if (size_t(got) != len)
+      fail("truncated");
+    pos += len;
+  }
+}
+
+void checkpoint_t::io(std::string& s)
+{
+  uint64_t size = s.size();
+  io(size);
+  s.resize(size);
+  bytes(s.data(), size);
+}
+
+void checkpoint_t::fail(const std::string& what)
+{
+  throw std::runtime_error("checkpoint " + path + ": " + what);
+}
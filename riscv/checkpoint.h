@@ -0,0 +1,99 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_CHECKPOINT_H
+#define _RISCV_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <type_traits>
+#include <vector>
+
+// A checkpoint file, open either to save the machine's state or to restore
+// it.  Each part of the machine that holds state has a checkpoint() method
+// that passes its fields to io() in a fixed order: saving writes them out
+// and restoring reads them back in, so the one method serves both ways.
+//
+// Fields are stored as their host representation, so a checkpoint can only
+// be restored by a spike built for the same kind of host as the one that
+// saved it.  Errors throw std::runtime_error.
+class checkpoint_t
+{
+public:
+  enum mode_t { SAVE, RESTORE };
+
+  checkpoint_t(const std::string& path, mode_t mode);
+  ~checkpoint_t();
+
+  bool saving() const { return mode == SAVE; }
+
+  // Whether memory holds only the pages written since the checkpoint
+  // before this one, rather than all of them
+  bool incremental = false;
+
+  // Mark the start of a part of the machine, so that a restore which has
+  // got out of step with the save stops there instead of reading one
+  // part's fields into another.
+  void section(const char* name);
+
+  // Save `value`, or on restore insist that the saved value matches it;
+  // for configuration that the state which follows depends on.
+  template<typename T> void expect(const T& value, const char* what)
+  {
+    T saved = value;
+    io(saved);
+    if (!(saved == value))
+      fail(std::string("machine differs in ") + what);
+  }
+
+  void bytes(void* data, size_t len);
+
+  template<typename T> void io(T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "field needs an io() overload");
+    bytes(&value, sizeof(value));
+  }
+
+  void io(std::string& s);
+
+  template<typename T> void io(std::vector<T>& v)
+  {
+    uint64_t size = v.size();
+    io(size);
+    v.resize(size);
+    for (auto& x : v)
+      io(x);
+  }
+
+  template<typename K, typename V> void io(std::map<K, V>& m)
+  {
+    uint64_t size = m.size();
+    io(size);
+    if (saving()) {
+      for (auto& [key, value] : m) {
+        K k = key;
+        io(k);
+        io(value);
+      }
+    } else {
+      m.clear();
+      for (uint64_t i = 0; i < size; i++) {
+        K k;
+        io(k);
+        io(m[k]);
+      }
+    }
+  }
+
+private:
+  [[noreturn]] void fail(const std::string& what);
+
+  const std::string path;
+  const mode_t mode;
+  FILE* file;
+  off_t pos = 0; // while restoring
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include "simif.h"
 #include "sim.h"
 #include "dts.h"
+#include "checkpoint.h"
 
 clint_t::clint_t(const simif_t* sim, uint64_t freq_hz, bool real_time)
   : sim(sim), freq_hz(freq_hz), real_time(real_time), mtime(0)
@@ -116,6 +117,14 @@ void clint_t::tick(reg_t rtc_ticks)
   }
 }
 
+void clint_t::checkpoint(checkpoint_t& c)
+{
+  // msip and the time CSRs live in the harts
+  c.section("clint");
+  c.io(mtime);
+  c.io(mtimecmp);
+}
+
 clint_t* clint_parse_from_fdt(const void* fdt, const sim_t* sim, reg_t* base,
     const std::vector<std::string>& UNUSED sargs) {
   if (fdt_parse_clint(fdt, base, "riscv,clint0") == 0 || fdt_parse_clint(fdt, base, "sifive,clint0") == 0)
@@ -15,6 +15,8 @@
 #include "insn_macros.h"
 // For CSR_DCSR_V:
 #include "debug_defines.h"
+// For checkpoint_t:
+#include "checkpoint.h"
 
 // STATE macro used by require_privilege() macro:
 #undef STATE
@@ -77,6 +79,10 @@ basic_csr_t::basic_csr_t(processor_t* const proc, const reg_t addr, const reg_t
   val(init) {
 }
 
+void basic_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool basic_csr_t::unlogged_write(const reg_t val) noexcept {
   this->val = val;
   return true;
@@ -106,6 +112,11 @@ reg_t pmpaddr_csr_t::read() const noexcept {
   return val & proc->pmp_tor_mask();
 }
 
+void pmpaddr_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+  c.io(cfg);
+}
+
 bool pmpaddr_csr_t::unlogged_write(const reg_t val) noexcept {
   // If no PMPs are configured, disallow access to all. Otherwise,
   // allow access to all, but unimplemented ones are hardwired to
@@ -123,6 +134,7 @@ bool pmpaddr_csr_t::unlogged_write(const reg_t val) noexcept {
   }
   else
     return false;
+  proc->get_mmu()->pmp_changed();
   proc->get_mmu()->flush_tlb();
   return true;
 }
@@ -158,26 +170,18 @@ bool pmpaddr_csr_t::match4(reg_t addr) const noexcept {
   return ((addr ^ tor_paddr()) & napot_mask()) == 0;
 }
 
-bool pmpaddr_csr_t::subset_match(reg_t addr, reg_t len) const noexcept {
-  if ((addr | len) & (len - 1))
-    abort();
-  reg_t base = tor_base_paddr();
-  reg_t tor = tor_paddr();
-
+bool pmpaddr_csr_t::match_range(reg_t& first, reg_t& last) const noexcept {
   if ((cfg & PMP_A) == 0) return false;
-
   bool is_tor = (cfg & PMP_A) == PMP_TOR;
-  bool begins_after_lower = addr >= base;
-  bool begins_after_upper = addr >= tor;
-  bool ends_before_lower = (addr & -len) < (base & -len);
-  bool ends_before_upper = (addr & -len) < (tor & -len);
-  bool tor_homogeneous = ends_before_lower || begins_after_upper ||
-    (begins_after_lower && ends_before_upper);
-
-  bool mask_homogeneous = ~(napot_mask() << 1) & len;
-  bool napot_homogeneous = mask_homogeneous || ((addr ^ tor) / len) != 0;
-
-  return !(is_tor ? tor_homogeneous : napot_homogeneous);
+  if (is_tor) {
+    first = tor_base_paddr();
+    last = tor_paddr() - 1;
+    return first < tor_paddr();
+  }
+  // NAPOT or NA4:
+  first = tor_paddr() & napot_mask();
+  last = first | ~napot_mask();
+  return true;
 }
 
 bool pmpaddr_csr_t::access_ok(access_type type, reg_t mode, bool hlvx) const noexcept {
@@ -274,6 +278,7 @@ bool pmpcfg_csr_t::unlogged_write(const reg_t val) noexcept {
       write_success = true;
     }
   }
+  proc->get_mmu()->pmp_changed();
   proc->get_mmu()->flush_tlb();
   return write_success;
 }
@@ -336,6 +341,7 @@ bool mseccfg_csr_t::unlogged_write(const reg_t val) noexcept {
     new_val = (new_val & ~mask) | (val & mask);
   }
 
+  proc->get_mmu()->pmp_changed();
   proc->get_mmu()->flush_tlb();
 
   if (proc->extension_enabled(EXT_ZICFILP)) {
@@ -367,6 +373,11 @@ reg_t virtualized_csr_t::readvirt(bool virt) const noexcept {
   return virt ? virt_csr->read() : orig_csr->read();
 }
 
+void virtualized_csr_t::checkpoint(checkpoint_t& c) {
+  orig_csr->checkpoint(c);
+  virt_csr->checkpoint(c);
+}
+
 bool virtualized_csr_t::unlogged_write(const reg_t val) noexcept {
   if (state->v)
     virt_csr->write(val);
@@ -385,6 +396,10 @@ reg_t epc_csr_t::read() const noexcept {
   return val & proc->pc_alignment_mask();
 }
 
+void epc_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool epc_csr_t::unlogged_write(const reg_t val) noexcept {
   this->val = val & ~(reg_t)1;
   return true;
@@ -400,6 +415,10 @@ reg_t tvec_csr_t::read() const noexcept {
   return val;
 }
 
+void tvec_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool tvec_csr_t::unlogged_write(const reg_t val) noexcept {
   this->val = val & ~(reg_t)2;
   return true;
@@ -462,10 +481,11 @@ reg_t base_status_csr_t::adjust_sd(const reg_t val) const noexcept {
 }
 
 void base_status_csr_t::maybe_flush_tlb(const reg_t newval) noexcept {
-  if ((newval ^ read()) &
-      (MSTATUS_MPP | MSTATUS_MPRV
-       | (has_page ? (MSTATUS_MXR | MSTATUS_SUM) : 0)
-      ))
+  // MPP only matters to translation while MPRV is set, and every trap into
+  // M-mode and mret changes it, so don't drop the TLB and icache for it
+  const reg_t diff = newval ^ read();
+  if ((diff & (MSTATUS_MPRV | (has_page ? (MSTATUS_MXR | MSTATUS_SUM) : 0))) ||
+      ((diff & MSTATUS_MPP) && (newval & MSTATUS_MPRV)))
     proc->get_mmu()->flush_tlb();
 }
 
@@ -485,6 +505,10 @@ vsstatus_csr_t::vsstatus_csr_t(processor_t* const proc, const reg_t addr):
   val(proc->get_state()->mstatus->read() & sstatus_read_mask) {
 }
 
+void vsstatus_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool vsstatus_csr_t::unlogged_write(const reg_t val) noexcept {
   const reg_t hDTE = (state->henvcfg->read() & HENVCFG_DTE);
   const reg_t adj_write_mask = sstatus_write_mask & ~(hDTE ? 0 : SSTATUS_SDT);
@@ -536,6 +560,10 @@ mstatus_csr_t::mstatus_csr_t(processor_t* const proc, const reg_t addr):
   val(compute_mstatus_initial_value()) {
 }
 
+void mstatus_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool mstatus_csr_t::unlogged_write(const reg_t val) noexcept {
   const bool has_mpv = proc->extension_enabled('H');
   const bool has_gva = has_mpv;
@@ -608,6 +636,10 @@ void rv32_low_csr_t::verify_permissions(insn_t insn, bool write) const {
   orig->verify_permissions(insn, write);
 }
 
+void rv32_low_csr_t::checkpoint(checkpoint_t& c) {
+  orig->checkpoint(c);
+}
+
 bool rv32_low_csr_t::unlogged_write(const reg_t val) noexcept {
   return orig->unlogged_write((orig->written_value() >> 32 << 32) | (val & 0xffffffffU));
 }
@@ -630,6 +662,10 @@ void rv32_high_csr_t::verify_permissions(insn_t insn, bool write) const {
   orig->verify_permissions(insn, write);
 }
 
+void rv32_high_csr_t::checkpoint(checkpoint_t& c) {
+  orig->checkpoint(c);
+}
+
 bool rv32_high_csr_t::unlogged_write(const reg_t val) noexcept {
   return orig->unlogged_write((orig->written_value() << 32 >> 32) | ((val & 0xffffffffU) << 32));
 }
@@ -748,6 +784,10 @@ bool misa_csr_t::unlogged_write(const reg_t val) noexcept {
     }
   }
 
+  // pre-decoded and translated blocks bake in the extension checks made
+  // when they were decoded
+  proc->get_mmu()->flush_icache();
+
   return basic_csr_t::unlogged_write(new_misa);
 }
 
@@ -771,6 +811,10 @@ void mip_or_mie_csr_t::write_with_mask(const reg_t mask, const reg_t val) noexce
   log_write();
 }
 
+void mip_or_mie_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool mip_or_mie_csr_t::unlogged_write(const reg_t val) noexcept {
   write_with_mask(write_mask(), val);
   return false; // avoid double logging: already logged by write_with_mask()
@@ -982,6 +1026,9 @@ bool envcfg_csr_t::unlogged_write(const reg_t val) noexcept {
 
   if (get_field(adjusted_val, MENVCFG_PMM) != get_field(read(), MENVCFG_PMM))
     proc->get_mmu()->flush_tlb();
+  // PBMTE, ADUE and SSE decide which PTEs the saved walks could accept
+  if (adjusted_val != read())
+    proc->get_mmu()->flush_stlb();
 
   return masked_csr_t::unlogged_write(adjusted_val);
 }
@@ -999,8 +1046,10 @@ base_atp_csr_t::base_atp_csr_t(processor_t* const proc, const reg_t addr):
 
 bool base_atp_csr_t::unlogged_write(const reg_t val) noexcept {
   const reg_t newval = proc->supports_impl(IMPL_MMU) ? compute_new_satp(val) : 0;
-  if (newval != read())
+  if (newval != read()) {
     proc->get_mmu()->flush_tlb();
+    proc->get_mmu()->flush_walk_cache();
+  }
   return basic_csr_t::unlogged_write(newval);
 }
 
@@ -1089,6 +1138,10 @@ void wide_counter_csr_t::bump(const reg_t howmuch) noexcept {
   config_csr->reset_prev();
 }
 
+void wide_counter_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(val);
+}
+
 bool wide_counter_csr_t::unlogged_write(const reg_t val) noexcept {
   this->val = val;
   // The ISA mandates that if an instruction writes instret, the write
@@ -1136,6 +1189,10 @@ reg_t time_counter_csr_t::read() const noexcept {
     return shadow_val;
 }
 
+void time_counter_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(shadow_val);
+}
+
 void time_counter_csr_t::sync(const reg_t val) noexcept {
   shadow_val = val;
   if (proc->extension_enabled(EXT_SSTC)) {
@@ -1155,6 +1212,10 @@ reg_t proxy_csr_t::read() const noexcept {
   return delegate->read();
 }
 
+void proxy_csr_t::checkpoint(checkpoint_t& c) {
+  delegate->checkpoint(c);
+}
+
 bool proxy_csr_t::unlogged_write(const reg_t val) noexcept {
   delegate->write(val);  // log only under the original (delegate's) name
   return false;
@@ -1243,6 +1304,7 @@ void hgatp_csr_t::verify_permissions(insn_t insn, bool write) const {
 
 bool hgatp_csr_t::unlogged_write(const reg_t val) noexcept {
   proc->get_mmu()->flush_tlb();
+  proc->get_mmu()->flush_walk_cache();
 
   reg_t mask;
   if (proc->get_const_xlen() == 32) {
@@ -1378,6 +1440,21 @@ reg_t dcsr_csr_t::read() const noexcept {
   return result;
 }
 
+void dcsr_csr_t::checkpoint(checkpoint_t& c) {
+  c.io(prv);
+  c.io(step);
+  c.io(ebreakm);
+  c.io(ebreaks);
+  c.io(ebreaku);
+  c.io(ebreakvs);
+  c.io(ebreakvu);
+  c.io(v);
+  c.io(cause);
+  c.io(ext_cause);
+  c.io(cetrig);
+  c.io(pelp);
+}
+
 bool dcsr_csr_t::unlogged_write(const reg_t val) noexcept {
   prv = get_field(val, DCSR_PRV);
   step = get_field(val, DCSR_STEP);
@@ -1800,6 +1877,11 @@ void smcntrpmf_csr_t::reset_prev() noexcept {
   prev_val.reset();
 }
 
+void smcntrpmf_csr_t::checkpoint(checkpoint_t& c) {
+  masked_csr_t::checkpoint(c);
+  c.io(prev_val);
+}
+
 bool smcntrpmf_csr_t::unlogged_write(const reg_t val) noexcept {
   prev_val = read();
   return masked_csr_t::unlogged_write(val);
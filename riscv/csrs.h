@@ -20,6 +20,7 @@
 
 class processor_t;
 struct state_t;
+class checkpoint_t;
 
 enum struct elp_t {
   NO_LP_EXPECTED = 0,
@@ -43,6 +44,11 @@ class csr_t {
   // Child classes must implement unlogged_write()
   void write(const reg_t val) noexcept;
 
+  // Save or restore the state this CSR holds, bypassing write() and its
+  // side effects; see checkpoint.h.  A CSR that wraps others passes this
+  // on to them, as they need not be in the csrmap themselves.
+  virtual void checkpoint(checkpoint_t UNUSED &c) {}
+
   virtual ~csr_t();
 
  protected:
@@ -78,6 +84,7 @@ typedef std::shared_ptr<csr_t> csr_t_p;
 class basic_csr_t: public csr_t {
  public:
   basic_csr_t(processor_t* const proc, const reg_t addr, const reg_t init);
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual reg_t read() const noexcept override {
     return val;
@@ -92,14 +99,15 @@ class basic_csr_t: public csr_t {
 class pmpaddr_csr_t: public csr_t {
  public:
   pmpaddr_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual void verify_permissions(insn_t insn, bool write) const override;
   virtual reg_t read() const noexcept override;
 
   // Does a 4-byte access at the specified address match this PMP entry?
   bool match4(reg_t addr) const noexcept;
 
-  // Does the specified range match only a proper subset of this page?
-  bool subset_match(reg_t addr, reg_t len) const noexcept;
+  // The first and last addresses this PMP entry matches, if it matches any
+  bool match_range(reg_t& first, reg_t& last) const noexcept;
 
   // Is the specified access allowed given the pmpcfg privileges?
   bool access_ok(access_type type, reg_t mode, bool hlvx) const noexcept;
@@ -169,6 +177,7 @@ typedef std::shared_ptr<mseccfg_csr_t> mseccfg_csr_t_p;
 class virtualized_csr_t: public csr_t {
  public:
   virtualized_csr_t(processor_t* const proc, csr_t_p orig, csr_t_p virt);
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual reg_t read() const noexcept override;
   // Instead of using state.v, explicitly request original or virtual:
@@ -185,6 +194,7 @@ typedef std::shared_ptr<virtualized_csr_t> virtualized_csr_t_p;
 class epc_csr_t: public csr_t {
  public:
   epc_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual reg_t read() const noexcept override;
  protected:
@@ -197,6 +207,7 @@ class epc_csr_t: public csr_t {
 class tvec_csr_t: public csr_t {
  public:
   tvec_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual reg_t read() const noexcept override;
  protected:
@@ -240,6 +251,7 @@ typedef std::shared_ptr<base_status_csr_t> base_status_csr_t_p;
 class vsstatus_csr_t final: public base_status_csr_t {
  public:
   vsstatus_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual reg_t read() const noexcept override;
 
@@ -254,6 +266,7 @@ typedef std::shared_ptr<vsstatus_csr_t> vsstatus_csr_t_p;
 class mstatus_csr_t final: public base_status_csr_t {
  public:
   mstatus_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
 
   reg_t read() const noexcept override {
     return val;
@@ -280,6 +293,7 @@ class mnstatus_csr_t final: public basic_csr_t {
 class rv32_low_csr_t: public csr_t {
  public:
   rv32_low_csr_t(processor_t* const proc, const reg_t addr, csr_t_p orig);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual reg_t read() const noexcept override;
   virtual void verify_permissions(insn_t insn, bool write) const override;
  protected:
@@ -292,6 +306,7 @@ class rv32_low_csr_t: public csr_t {
 class rv32_high_csr_t: public csr_t {
  public:
   rv32_high_csr_t(processor_t* const proc, const reg_t addr, csr_t_p orig);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual reg_t read() const noexcept override;
   virtual void verify_permissions(insn_t insn, bool write) const override;
  protected:
@@ -354,6 +369,7 @@ typedef std::shared_ptr<misa_csr_t> misa_csr_t_p;
 class mip_or_mie_csr_t: public csr_t {
  public:
   mip_or_mie_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual reg_t read() const noexcept override;
 
   void write_with_mask(const reg_t mask, const reg_t val) noexcept;
@@ -537,6 +553,7 @@ typedef std::shared_ptr<smcntrpmf_csr_t> smcntrpmf_csr_t_p;
 class wide_counter_csr_t: public csr_t {
  public:
   wide_counter_csr_t(processor_t* const proc, const reg_t addr, smcntrpmf_csr_t_p config_csr);
+  virtual void checkpoint(checkpoint_t& c) override;
   // Always returns full 64-bit value
   virtual reg_t read() const noexcept override;
   void bump(const reg_t howmuch) noexcept;
@@ -554,6 +571,7 @@ typedef std::shared_ptr<wide_counter_csr_t> wide_counter_csr_t_p;
 class time_counter_csr_t: public csr_t {
  public:
   time_counter_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual reg_t read() const noexcept override;
 
   void sync(const reg_t val) noexcept;
@@ -570,6 +588,7 @@ typedef std::shared_ptr<time_counter_csr_t> time_counter_csr_t_p;
 class proxy_csr_t: public csr_t {
  public:
   proxy_csr_t(processor_t* const proc, const reg_t addr, csr_t_p delegate);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual reg_t read() const noexcept override;
  protected:
   bool unlogged_write(const reg_t val) noexcept override;
@@ -682,6 +701,7 @@ class dpc_csr_t: public epc_csr_t {
 class dcsr_csr_t: public csr_t {
  public:
   dcsr_csr_t(processor_t* const proc, const reg_t addr);
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual void verify_permissions(insn_t insn, bool write) const override;
   virtual reg_t read() const noexcept override;
   void update_fields(const uint8_t cause, const uint8_t ext_cause, const reg_t prv,
@@ -854,6 +874,7 @@ class sscsrind_reg_csr_t : public csr_t {
 class smcntrpmf_csr_t : public masked_csr_t {
  public:
   smcntrpmf_csr_t(processor_t* const proc, const reg_t addr, const reg_t mask, const reg_t init);
+  virtual void checkpoint(checkpoint_t& c) override;
   reg_t read_prev() const noexcept;
   void reset_prev() noexcept;
  protected:
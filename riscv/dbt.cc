@@ -0,0 +1,350 @@
+// See LICENSE for license details.
+
+#include "config.h"
+#include "dbt.h"
+#include "mmu.h"
+#include "processor.h"
+#include <sys/mman.h>
+#include <cstring>
+
+namespace {
+
+enum alu_op_t { OP_ADD, OP_SUB, OP_AND, OP_OR, OP_XOR, OP_SLL, OP_SRL, OP_SRA, OP_SLT, OP_SLTU, OP_MUL };
+
+// a uop reduced to the handful of forms the emitter understands
+struct host_op_t {
+  enum { ALU, LI, LOAD, STORE } form;
+  alu_op_t op;
+  bool word;      // ALU: operate on the low 32 bits and sign-extend
+  bool use_imm;   // ALU: second operand is imm rather than rs2
+  size_t size;    // LOAD/STORE: access size in bytes
+  bool sign;      // LOAD: sign-extend the loaded value
+  reg_t rd, rs1, rs2;
+  int64_t imm;
+};
+
+bool lower(const uop_t& u, host_op_t* h)
+{
+  *h = {host_op_t::ALU, OP_ADD, false, false, 0, false, u.rd, u.rs1, u.rs2, u.imm};
+
+  auto alu = [&](alu_op_t op, bool use_imm, bool word = false) {
+    h->op = op;
+    h->use_imm = use_imm;
+    h->word = word;
+  };
+  auto mem = [&](decltype(h->form) form, size_t size, bool sign) {
+    h->form = form;
+    h->size = size;
+    h->sign = sign;
+  };
+
+  switch (u.op) {
+    case UOP_NONE: return false;
+    case UOP_ADD: alu(OP_ADD, false); break;
+    case UOP_SUB: alu(OP_SUB, false); break;
+    case UOP_SLL: alu(OP_SLL, false); break;
+    case UOP_SLT: alu(OP_SLT, false); break;
+    case UOP_SLTU: alu(OP_SLTU, false); break;
+    case UOP_XOR: alu(OP_XOR, false); break;
+    case UOP_SRL: alu(OP_SRL, false); break;
+    case UOP_SRA: alu(OP_SRA, false); break;
+    case UOP_OR: alu(OP_OR, false); break;
+    case UOP_AND: alu(OP_AND, false); break;
+    case UOP_MUL: alu(OP_MUL, false); break;
+    case UOP_ADDW: alu(OP_ADD, false, true); break;
+    case UOP_SUBW: alu(OP_SUB, false, true); break;
+    case UOP_SLLW: alu(OP_SLL, false, true); break;
+    case UOP_SRLW: alu(OP_SRL, false, true); break;
+    case UOP_SRAW: alu(OP_SRA, false, true); break;
+    case UOP_MULW: alu(OP_MUL, false, true); break;
+    case UOP_ADDI: alu(OP_ADD, true); break;
+    case UOP_SLTI: alu(OP_SLT, true); break;
+    case UOP_SLTIU: alu(OP_SLTU, true); break;
+    case UOP_XORI: alu(OP_XOR, true); break;
+    case UOP_ORI: alu(OP_OR, true); break;
+    case UOP_ANDI: alu(OP_AND, true); break;
+    case UOP_SLLI: alu(OP_SLL, true); break;
+    case UOP_SRLI: alu(OP_SRL, true); break;
+    case UOP_SRAI: alu(OP_SRA, true); break;
+    case UOP_ADDIW: alu(OP_ADD, true, true); break;
+    case UOP_SLLIW: alu(OP_SLL, true, true); break;
+    case UOP_SRLIW: alu(OP_SRL, true, true); break;
+    case UOP_SRAIW: alu(OP_SRA, true, true); break;
+    case UOP_LI: h->form = host_op_t::LI; break;
+    case UOP_LB: mem(host_op_t::LOAD, 1, true); break;
+    case UOP_LH: mem(host_op_t::LOAD, 2, true); break;
+    case UOP_LW: mem(host_op_t::LOAD, 4, true); break;
+    case UOP_LD: mem(host_op_t::LOAD, 8, true); break;
+    case UOP_LBU: mem(host_op_t::LOAD, 1, false); break;
+    case UOP_LHU: mem(host_op_t::LOAD, 2, false); break;
+    case UOP_LWU: mem(host_op_t::LOAD, 4, false); break;
+    case UOP_SB: mem(host_op_t::STORE, 1, false); break;
+    case UOP_SH: mem(host_op_t::STORE, 2, false); break;
+    case UOP_SW: mem(host_op_t::STORE, 4, false); break;
+    case UOP_SD: mem(host_op_t::STORE, 8, false); break;
+    default: return false; // branches end the translated prefix
+  }
+
+  return true;
+}
+
+#ifdef __x86_64__
+
+// x86-64 register numbers
+enum { RAX = 0, RCX = 1, RDX = 2, RDI = 7, R8 = 8 };
+
+class emitter_t
+{
+public:
+  emitter_t(uint8_t* buf) : start(buf), p(buf) {}
+
+  size_t size() const { return p - start; }
+
+  void byte(uint8_t b) { *p++ = b; }
+  void bytes(std::initializer_list<uint8_t> bs) { for (auto b : bs) byte(b); }
+  void imm32(int32_t v) { memcpy(p, &v, 4); p += 4; }
+  void imm64(uint64_t v) { memcpy(p, &v, 8); p += 8; }
+
+  // movabs reg, imm64 (reg is RDI or R8)
+  void mov_imm64(int reg, uint64_t v)
+  {
+    bytes({uint8_t(reg >= 8 ? 0x49 : 0x48), uint8_t(0xb8 + (reg & 7))});
+    imm64(v);
+  }
+
+  // reg = x[r], where reg is RAX, RCX or RDX and RDI points at the XPRs
+  void read_xpr(int reg, reg_t r)
+  {
+    if (r == 0) {
+      bytes({0x31, uint8_t(0xc0 | reg << 3 | reg)});
+    } else {
+      bytes({0x48, 0x8b, uint8_t(0x87 | reg << 3)});
+      imm32(r * sizeof(reg_t));
+    }
+  }
+
+  // x[r] = rax
+  void write_xpr(reg_t r)
+  {
+    if (r == 0)
+      return;
+    bytes({0x48, 0x89, 0x87});
+    imm32(r * sizeof(reg_t));
+  }
+
+  // return the number of instructions completed so far
+  void exit(size_t done)
+  {
+    byte(0xb8);
+    imm32(done);
+    byte(0xc3);
+  }
+
+  // skip over an exit stub when the preceding test sets ZF
+  void exit_unless_zero(size_t done)
+  {
+    bytes({0x74, 0x06});
+    exit(done);
+  }
+
+private:
+  uint8_t* start;
+  uint8_t* p;
+};
+
+void emit_alu(emitter_t& e, const host_op_t& u)
+{
+  uint8_t rex = u.word ? 0 : 0x48;
+  auto op = [&](std::initializer_list<uint8_t> bs) {
+    if (rex)
+      e.byte(rex);
+    e.bytes(bs);
+  };
+  int shamt_mask = u.word ? 31 : 63;
+
+  e.read_xpr(RAX, u.rs1);
+  if (u.use_imm) {
+    switch (u.op) {
+      case OP_ADD: op({0x05}); e.imm32(u.imm); break;
+      case OP_AND: op({0x25}); e.imm32(u.imm); break;
+      case OP_OR: op({0x0d}); e.imm32(u.imm); break;
+      case OP_XOR: op({0x35}); e.imm32(u.imm); break;
+      case OP_SLL: op({0xc1, 0xe0, uint8_t(u.imm & shamt_mask)}); break;
+      case OP_SRL: op({0xc1, 0xe8, uint8_t(u.imm & shamt_mask)}); break;
+      case OP_SRA: op({0xc1, 0xf8, uint8_t(u.imm & shamt_mask)}); break;
+      case OP_SLT:
+      case OP_SLTU:
+        op({0x3d}); e.imm32(u.imm);
+        e.bytes({0x0f, uint8_t(u.op == OP_SLT ? 0x9c : 0x92), 0xc0});
+        e.bytes({0x0f, 0xb6, 0xc0});
+        break;
+      default: abort();
+    }
+  } else {
+    e.read_xpr(RCX, u.rs2);
+    switch (u.op) {
+      case OP_ADD: op({0x01, 0xc8}); break;
+      case OP_SUB: op({0x29, 0xc8}); break;
+      case OP_AND: op({0x21, 0xc8}); break;
+      case OP_OR: op({0x09, 0xc8}); break;
+      case OP_XOR: op({0x31, 0xc8}); break;
+      case OP_SLL: op({0xd3, 0xe0}); break;
+      case OP_SRL: op({0xd3, 0xe8}); break;
+      case OP_SRA: op({0xd3, 0xf8}); break;
+      case OP_MUL: op({0x0f, 0xaf, 0xc1}); break;
+      case OP_SLT:
+      case OP_SLTU:
+        op({0x39, 0xc8});
+        e.bytes({0x0f, uint8_t(u.op == OP_SLT ? 0x9c : 0x92), 0xc0});
+        e.bytes({0x0f, 0xb6, 0xc0});
+        break;
+    }
+  }
+
+  if (u.word)
+    e.bytes({0x48, 0x63, 0xc0}); // movsxd rax, eax
+  e.write_xpr(u.rd);
+}
+
+// Leave the host address of x[rs1] + imm in r8 + rax, or exit with `done`
+// if the simulator TLB would not let the interpreter's fast path through.
+void emit_tlb_lookup(emitter_t& e, const host_op_t& u, const reg_t* tags,
+                     const tlb_entry_t* data, size_t tlb_entries, size_t done)
+{
+  e.read_xpr(RAX, u.rs1);
+  if (u.imm) {
+    e.bytes({0x48, 0x05});
+    e.imm32(u.imm);
+  }
+  if (u.size > 1) {
+    e.bytes({0xa8, uint8_t(u.size - 1)}); // test al, size-1
+    e.exit_unless_zero(done);
+  }
+  e.bytes({0x48, 0x89, 0xc2});            // mov rdx, rax
+  e.bytes({0x48, 0xc1, 0xea, PGSHIFT});   // shr rdx, PGSHIFT
+  e.bytes({0x89, 0xd1});                  // mov ecx, edx
+  e.bytes({0x81, 0xe1});                  // and ecx, tlb_entries-1
+  e.imm32(tlb_entries - 1);
+  e.mov_imm64(R8, (uint64_t)tags);
+  e.bytes({0x49, 0x39, 0x14, 0xc8});      // cmp [r8+rcx*8], rdx
+  e.exit_unless_zero(done);
+  static_assert(sizeof(tlb_entry_t) == 16);
+  e.bytes({0xc1, 0xe1, 0x04});            // shl ecx, 4
+  e.mov_imm64(R8, (uint64_t)&data->host_offset);
+  e.bytes({0x4d, 0x8b, 0x04, 0x08});      // mov r8, [r8+rcx]
+}
+
+void emit_load(emitter_t& e, const host_op_t& u, const reg_t* tags,
+               const tlb_entry_t* data, size_t tlb_entries, size_t done)
+{
+  emit_tlb_lookup(e, u, tags, data, tlb_entries, done);
+  switch (u.size) {
+    case 1: e.bytes({0x41, 0x0f, uint8_t(u.sign ? 0xbe : 0xb6), 0x04, 0x00}); break;
+    case 2: e.bytes({0x41, 0x0f, uint8_t(u.sign ? 0xbf : 0xb7), 0x04, 0x00}); break;
+    case 4: e.bytes({uint8_t(u.sign ? 0x49 : 0x41), uint8_t(u.sign ? 0x63 : 0x8b), 0x04, 0x00}); break;
+    case 8: e.bytes({0x49, 0x8b, 0x04, 0x00}); break;
+  }
+  if (u.sign && u.size < 4) {
+    // movsx into eax above; widen to the full register
+    e.bytes({0x48, 0x63, 0xc0});
+  }
+  e.write_xpr(u.rd);
+}
+
+void emit_store(emitter_t& e, const host_op_t& u, const reg_t* tags,
+                const tlb_entry_t* data, size_t tlb_entries, size_t done)
+{
+  emit_tlb_lookup(e, u, tags, data, tlb_entries, done);
+  e.read_xpr(RDX, u.rs2);
+  switch (u.size) {
+    case 1: e.bytes({0x41, 0x88, 0x14, 0x00}); break;
+    case 2: e.bytes({0x66, 0x41, 0x89, 0x14, 0x00}); break;
+    case 4: e.bytes({0x41, 0x89, 0x14, 0x00}); break;
+    case 8: e.bytes({0x49, 0x89, 0x14, 0x00}); break;
+  }
+}
+
+#endif
+
+}
+
+dbt_t::dbt_t(processor_t* proc)
+  : proc(proc), mmu(proc->get_mmu()), code(nullptr), code_used(0)
+{
+  void* p = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p != MAP_FAILED)
+    code = (uint8_t*)p;
+}
+
+dbt_t::~dbt_t()
+{
+  if (code)
+    munmap(code, CODE_SIZE);
+}
+
+bool dbt_t::supported()
+{
+#ifdef __x86_64__
+  return true;
+#else
+  return false;
+#endif
+}
+
+void dbt_t::translate(icache_block_t* block)
+{
+#ifdef __x86_64__
+  if (!code || mmu->target_big_endian)
+    return;
+
+  if (code_used + MAX_BLOCK_CODE > CODE_SIZE) {
+    // start over; dropping the icache drops every pointer into the buffer
+    code_used = 0;
+    mmu->flush_icache();
+    return;
+  }
+
+  uint8_t* start = code + code_used;
+  emitter_t e(start);
+  e.mov_imm64(RDI, (uint64_t)&proc->get_state()->XPR[0]);
+
+  size_t n = 0;
+  for (; n + 1 < block->size; n++) {
+    host_op_t u;
+    if (!lower(block->insns[n].uop, &u))
+      break;
+
+    switch (u.form) {
+      case host_op_t::ALU:
+        if (u.rd != 0)
+          emit_alu(e, u);
+        break;
+      case host_op_t::LI:
+        if (u.imm == int32_t(u.imm)) {
+          e.bytes({0x48, 0xc7, 0xc0});
+          e.imm32(u.imm);
+        } else {
+          e.bytes({0x48, 0xb8});
+          e.imm64(u.imm);
+        }
+        e.write_xpr(u.rd);
+        break;
+      case host_op_t::LOAD:
+        emit_load(e, u, mmu->tlb_load_tag, mmu->tlb_data, mmu_t::TLB_ENTRIES, n);
+        break;
+      case host_op_t::STORE:
+        emit_store(e, u, mmu->tlb_store_tag, mmu->tlb_data, mmu_t::TLB_ENTRIES, n);
+        break;
+    }
+  }
+
+  if (n == 0)
+    return;
+
+  e.exit(n);
+  code_used += (e.size() + 15) & ~size_t(15);
+  block->native = (native_block_t)start;
+  block->native_insns = n;
+#endif
+}
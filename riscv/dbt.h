@@ -0,0 +1,46 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DBT_H
+#define _RISCV_DBT_H
+
+#include "decode.h"
+#include <cstddef>
+#include <cstdint>
+
+class processor_t;
+class mmu_t;
+struct icache_block_t;
+
+// Translates hot icache blocks of RV64 integer code into x86-64 host code.
+//
+// Only a prefix of a block is translated: it stops at the first instruction
+// the translator does not handle, and never includes the block's last
+// instruction, so the interpreter always finishes the block.  Loads and
+// stores probe the simulator TLB and hand back to the interpreter on a miss,
+// misalignment or trigger, so translated code never traps.
+class dbt_t
+{
+public:
+  dbt_t(processor_t* proc);
+  ~dbt_t();
+
+  // whether this host can run translated code at all
+  static bool supported();
+
+  // blocks are translated once they have been entered this many times
+  static const uint32_t HOT_THRESHOLD = 64;
+
+  void translate(icache_block_t* block);
+
+private:
+  processor_t* proc;
+  mmu_t* mmu;
+  uint8_t* code;
+  size_t code_used;
+
+  static const size_t CODE_SIZE = 8 << 20;
+  // upper bound on the host code emitted for one block
+  static const size_t MAX_BLOCK_CODE = 4096;
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include "debug_defines.h"
 #include "opcodes.h"
 #include "mmu.h"
+#include "checkpoint.h"
 
 #include "debug_rom/debug_rom.h"
 #include "debug_rom_defines.h"
@@ -86,6 +87,40 @@ debug_module_t::~debug_module_t()
   delete[] program_buffer;
 }
 
+void debug_module_t::checkpoint(checkpoint_t& c)
+{
+  c.section("debug module");
+  c.io(debug_rom_whereto);
+  c.io(debug_abstract);
+  c.expect(program_buffer_bytes, "debug program buffer size");
+  c.bytes(program_buffer, program_buffer_bytes);
+  c.io(dmdata);
+  c.io(hart_state);
+  c.io(debug_rom_flags);
+
+  c.io(dmcontrol);
+  c.io(dmstatus);
+  c.io(abstractcs);
+  c.io(abstractauto);
+  c.io(command);
+  c.io(hawindowsel);
+  for (size_t i = 0; i < hart_array_mask.size(); i++) {
+    bool selected = hart_array_mask[i];
+    c.io(selected);
+    hart_array_mask[i] = selected;
+  }
+
+  c.io(sbcs);
+  c.io(sbaddress);
+  c.io(sbdata);
+  c.io(challenge);
+  c.io(abstract_command_completed);
+  c.io(rti_remaining);
+  c.io(hart_available_state);
+  c.io(sb_read_wait);
+  c.io(sb_write_wait);
+}
+
 void debug_module_t::reset()
 {
   for (const auto& [hart_id, hart] : sim->get_harts()) {
@@ -129,6 +129,8 @@ class debug_module_t : public abstract_device_t
     // Called when one of the attached harts was reset.
     void proc_reset(unsigned id);
 
+    void checkpoint(checkpoint_t& c);
+
   private:
     static const unsigned datasize = 2;
     debug_module_config_t config;
@@ -0,0 +1,90 @@
+// See LICENSE for license details.
+
+#include "config.h"
+#include "decode_tree.h"
+#include "processor.h"
+#include <cassert>
+
+// leaves this short are scanned rather than split further
+static const size_t LEAF_SIZE = 4;
+static const unsigned MAX_FIELD_WIDTH = 8;
+
+void decode_tree_t::build(const std::vector<const insn_desc_t*>& descs)
+{
+  assert(!descs.empty() && descs.back()->mask == 0);
+
+  nodes.assign(1, node_t());
+  leaves.clear();
+  std::map<std::vector<const insn_desc_t*>, node_t> built;
+  nodes[0] = build_node(descs, 0, built);
+}
+
+const insn_desc_t* decode_tree_t::lookup(insn_bits_t bits) const
+{
+  const node_t* n = &nodes[0];
+  while (n->width)
+    n = &nodes[n->base + ((bits >> n->shift) & ((insn_bits_t(1) << n->width) - 1))];
+  for (auto p = &leaves[n->base]; ; p++)
+    if ((bits & (*p)->mask) == (*p)->match)
+      return *p;
+}
+
+decode_tree_t::node_t decode_tree_t::build_node(const std::vector<const insn_desc_t*>& descs,
+                                                insn_bits_t decided,
+                                                std::map<std::vector<const insn_desc_t*>, node_t>& built)
+{
+  // the same list turns up under many paths, e.g. each compressed
+  // instruction under every value of bits the others decode
+  auto it = built.find(descs);
+  if (it != built.end())
+    return it->second;
+
+  // switch on the widest run of undecided bits that the most instructions
+  // decode, since that splits the list most evenly
+  const unsigned nbits = 8 * sizeof(insn_bits_t);
+  size_t count[nbits] = {};
+  for (auto d : descs)
+    for (unsigned i = 0; i < nbits; i++)
+      count[i] += (d->mask & ~decided) >> i & 1;
+
+  size_t best = 0;
+  for (unsigned i = 0; i < nbits; i++)
+    best = std::max(best, count[i]);
+
+  node_t node = {0, 0, 0};
+  if (descs.size() <= LEAF_SIZE || best < 2) {
+    node.base = leaves.size();
+    leaves.insert(leaves.end(), descs.begin(), descs.end());
+  } else {
+    for (unsigned i = 0; i < nbits; ) {
+      unsigned width = 0;
+      while (i + width < nbits && width < MAX_FIELD_WIDTH && count[i + width] == best)
+        width++;
+      if (width > node.width) {
+        node.shift = i;
+        node.width = width;
+      }
+      i += width ? width : 1;
+    }
+
+    insn_bits_t field = ((insn_bits_t(1) << node.width) - 1) << node.shift;
+    node.base = nodes.size();
+    nodes.resize(nodes.size() + (size_t(1) << node.width));
+
+    // an instruction that ignores some of the field's bits goes under every
+    // value of them; filtering keeps each child's list in priority order
+    std::vector<const insn_desc_t*> child;
+    for (size_t v = 0; v < (size_t(1) << node.width); v++) {
+      insn_bits_t value = insn_bits_t(v) << node.shift;
+      child.clear();
+      for (auto d : descs)
+        if (((d->match ^ value) & d->mask & field) == 0)
+          child.push_back(d);
+      node_t n = build_node(child, decided | field, built);
+      nodes[node.base + v] = n;
+    }
+  }
+
+  built.emplace(descs, node);
+  return node;
+}
@@ -0,0 +1,41 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DECODE_TREE_H
+#define _RISCV_DECODE_TREE_H
+
+#include "decode.h"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+struct insn_desc_t;
+
+// Resolves an encoding to the first matching instruction of a priority-
+// ordered list.  Each interior node switches on a field of the encoding;
+// each leaf holds, in priority order, the few instructions still consistent
+// with the fields above it, ending with a catch-all.  So a lookup is a
+// handful of table indexings and a short scan, however many instructions
+// are registered.
+class decode_tree_t {
+ public:
+  // descs must end with an entry that matches everything, and must outlive
+  // the tree
+  void build(const std::vector<const insn_desc_t*>& descs);
+
+  const insn_desc_t* lookup(insn_bits_t bits) const;
+
+ private:
+  struct node_t {
+    uint8_t shift;
+    uint8_t width; // 0 for a leaf
+    uint32_t base; // first child in nodes, or first entry in leaves
+  };
+
+  node_t build_node(const std::vector<const insn_desc_t*>& descs, insn_bits_t decided,
+                    std::map<std::vector<const insn_desc_t*>, node_t>& built);
+
+  std::vector<node_t> nodes;
+  std::vector<const insn_desc_t*> leaves;
+};
+
+#endif
@@ -1,6 +1,13 @@
 #include "devices.h"
 #include "mmu.h"
+#include "checkpoint.h"
 #include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 mmio_device_map_t& mmio_device_map()
 {
@@ -10,51 +17,86 @@ mmio_device_map_t& mmio_device_map()
 
 void bus_t::add_device(reg_t addr, abstract_device_t* dev)
 {
-  // Searching devices via lower_bound/upper_bound
-  // implicitly relies on the underlying std::map 
-  // container to sort the keys and provide ordered
-  // iteration over this sort, which it does. (python's
-  // SortedDict is a good analogy)
-  devices[addr] = dev;
+  // Kept sorted so that the device for an address is the last one with a
+  // base at or below it (price-is-right search); a device added at an
+  // existing base replaces the old one.
+  range_t range = {addr, dev, dynamic_cast<abstract_mem_t*>(dev)};
+  auto it = std::lower_bound(devices.begin(), devices.end(), addr,
+    [](const range_t& r, reg_t a) { return r.base < a; });
+  if (it != devices.end() && it->base == addr)
+    *it = range;
+  else
+    devices.insert(it, range);
 }
 
-bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
+// The index of the device for addr, or devices.size() if there is none
+size_t bus_t::lookup(reg_t addr)
+{
+  // The device each host thread last hit, so each hart with --parallel.
+  // Drivers tend to poll the same device over and over.
+  static thread_local struct {
+    const bus_t* bus;
+    size_t index;
+  } last_hit = {nullptr, 0};
+
+  size_t i = last_hit.index;
+  if (last_hit.bus == this && i < devices.size() && devices[i].base <= addr &&
+      (i + 1 == devices.size() || addr < devices[i + 1].base))
+    return i;
+
+  auto it = std::upper_bound(devices.begin(), devices.end(), addr,
+    [](reg_t a, const range_t& r) { return a < r.base; });
+  if (it == devices.begin())
+    return devices.size();
+  i = it - devices.begin() - 1;
+  last_hit = {this, i};
+  return i;
+}
+
+bool bus_t::access(reg_t addr, size_t len, uint8_t* bytes, bool store)
 {
-  // Find the device with the base address closest to but
-  // less than addr (price-is-right search)
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
-    // Either the bus is empty, or there weren't 
-    // any items with a base address <= addr
+  size_t i = lookup(addr);
+  if (i == devices.size())
     return false;
+
+  reg_t offset = addr - devices[i].base;
+  abstract_device_t* dev = devices[i].dev;
+  if (len == 1 || dev->native_access(offset, len))
+    return store ? dev->store(offset, len, bytes) : dev->load(offset, len, bytes);
+
+  // a byte at a time, each of which might belong to the next device along
+  for (size_t j = 0; j < len; j++) {
+    if (!access(addr + j, 1, bytes + j, store))
+      return false;
   }
-  // Found at least one item with base address <= addr
-  // The iterator points to the device after this, so
-  // go back by one item.
-  it--;
-  return it->second->load(addr - it->first, len, bytes);
+  return true;
+}
+
+bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  return access(addr, len, bytes, false);
 }
 
 bool bus_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 {
-  // See comments in bus_t::load
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
-    return false;
-  }
-  it--;
-  return it->second->store(addr - it->first, len, bytes);
+  return access(addr, len, const_cast<uint8_t*>(bytes), true);
 }
 
 std::pair<reg_t, abstract_device_t*> bus_t::find_device(reg_t addr)
 {
-  // See comments in bus_t::load
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
+  size_t i = lookup(addr);
+  if (i == devices.size())
     return std::make_pair((reg_t)0, (abstract_device_t*)NULL);
-  }
-  it--;
-  return std::make_pair(it->first, it->second);
+  return std::make_pair(devices[i].base, devices[i].dev);
+}
+
+abstract_mem_t* bus_t::find_mem(reg_t addr, reg_t* offset)
+{
+  size_t i = lookup(addr);
+  if (i == devices.size() || !devices[i].mem)
+    return NULL;
+  *offset = addr - devices[i].base;
+  return *offset < devices[i].mem->size() ? devices[i].mem : NULL;
 }
 
 mem_t::mem_t(reg_t size)
@@ -62,6 +104,7 @@ mem_t::mem_t(reg_t size)
 {
   if (size == 0 || size % PGSIZE != 0)
     throw std::runtime_error("memory size must be a positive multiple of 4 KiB");
+  dirty.resize(sz / PGSIZE);
 }
 
 mem_t::~mem_t()
@@ -78,8 +121,10 @@ bool mem_t::load_store(reg_t addr, size_t len, uint8_t* bytes, bool store)
   while (len > 0) {
     auto n = std::min(PGSIZE - (addr % PGSIZE), reg_t(len));
 
-    if (store)
+    if (store) {
       memcpy(this->contents(addr), bytes, n);
+      mark_dirty(addr);
+    }
     else
       memcpy(bytes, this->contents(addr), n);
 
@@ -116,3 +161,184 @@ void mem_t::dump(std::ostream& o) {
     }
   }
 }
+
+void mem_t::mark_dirty(reg_t addr)
+{
+  dirty[addr >> PGSHIFT] = true;
+}
+
+void mem_t::checkpoint(checkpoint_t& c)
+{
+  c.expect(sz, "memory size");
+
+  // only the pages that have been touched, as for the map itself, or for
+  // an incremental checkpoint only those written since the last one
+  uint64_t pages = 0;
+  for (auto& entry : sparse_memory_map)
+    pages += !c.incremental || dirty[entry.first];
+  c.io(pages);
+  if (c.saving()) {
+    for (auto& [ppn, page] : sparse_memory_map) {
+      if (c.incremental && !dirty[ppn])
+        continue;
+      reg_t p = ppn;
+      c.io(p);
+      c.bytes(page, PGSIZE);
+    }
+  } else {
+    if (!c.incremental) {
+      for (auto& entry : sparse_memory_map)
+        free(entry.second);
+      sparse_memory_map.clear();
+    }
+    for (uint64_t i = 0; i < pages; i++) {
+      reg_t ppn;
+      c.io(ppn);
+      if (ppn >= dirty.size())
+        throw std::runtime_error("checkpoint page outside memory");
+      c.bytes(contents(ppn << PGSHIFT), PGSIZE);
+    }
+  }
+  dirty.assign(dirty.size(), false);
+}
+
+flat_mem_t::flat_mem_t(reg_t size, bool hugepages)
+  : base(NULL), hugepages(hugepages), sz(size)
+{
+  if (size == 0 || size % PGSIZE != 0)
+    throw std::runtime_error("memory size must be a positive multiple of 4 KiB");
+  if (size > SIZE_MAX)
+    throw std::runtime_error("memory size exceeds the host address space");
+  map(false);
+  dirty.resize(sz / PGSIZE);
+}
+
+flat_mem_t::~flat_mem_t()
+{
+  munmap(base, sz);
+}
+
+// Map the region, or map fresh zeroed pages over all of it
+void flat_mem_t::map(bool replace)
+{
+  // MAP_NORESERVE: a large guest that only touches a little of its memory
+  // shouldn't need the rest to be backed by swap
+  void* p = mmap(base, sz, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (replace ? MAP_FIXED : 0),
+                 -1, 0);
+  if (p == MAP_FAILED)
+    throw std::runtime_error(std::string("could not map memory: ") + strerror(errno));
+  base = (char*)p;
+
+#ifdef MADV_HUGEPAGE
+  // only advice; without THP support in the host this quietly does nothing
+  if (hugepages)
+    madvise(base, sz, MADV_HUGEPAGE);
+#endif
+}
+
+bool flat_mem_t::map_file(const char* path, reg_t fileoff, reg_t addr, reg_t len)
+{
+  if (fileoff % PGSIZE != 0 || addr % PGSIZE != 0 || addr + len < addr || addr + len > sz)
+    return false;
+  if (len == 0)
+    return true;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  // whole pages; past the end of the file, the last one reads as zeroes
+  reg_t maplen = (len + PGSIZE - 1) / PGSIZE * PGSIZE;
+  void* p = mmap(base + addr, maplen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, fileoff);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  for (reg_t ppn = addr >> PGSHIFT; ppn < (addr + maplen) >> PGSHIFT; ppn++)
+    dirty[ppn] = true;
+  return true;
+}
+
+bool flat_mem_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if (addr + len < addr || addr + len > sz)
+    return false;
+
+  memcpy(bytes, base + addr, len);
+  return true;
+}
+
+bool flat_mem_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  if (addr + len < addr || addr + len > sz)
+    return false;
+
+  memcpy(base + addr, bytes, len);
+  if (len > 0) {
+    for (reg_t ppn = addr >> PGSHIFT; ppn <= (addr + len - 1) >> PGSHIFT; ppn++)
+      dirty[ppn] = true;
+  }
+  return true;
+}
+
+void flat_mem_t::dump(std::ostream& o) {
+  o.write(base, sz);
+}
+
+void flat_mem_t::mark_dirty(reg_t addr)
+{
+  dirty[addr >> PGSHIFT] = true;
+}
+
+void flat_mem_t::checkpoint(checkpoint_t& c)
+{
+  c.expect(sz, "memory size");
+
+  // The same page list mem_t writes, so a checkpoint can be restored into
+  // either.  A full checkpoint has no map of touched pages to go by, so it
+  // skips the pages the host says were never populated, and those that are
+  // still all zeroes.
+  std::vector<reg_t> ppns;
+  if (c.saving()) {
+    static const char zeroes[PGSIZE] = {0};
+    reg_t host_pgsize = PGSIZE;
+    std::vector<unsigned char> resident;
+#ifdef __linux__
+    if (!c.incremental) {
+      host_pgsize = sysconf(_SC_PAGESIZE);
+      resident.resize((sz + host_pgsize - 1) / host_pgsize);
+      if (mincore(base, sz, resident.data()) != 0)
+        resident.clear();
+    }
+#endif
+    for (reg_t ppn = 0; ppn < dirty.size(); ppn++) {
+      reg_t offset = ppn << PGSHIFT;
+      bool save = c.incremental ? dirty[ppn] :
+        (resident.empty() || (resident[offset / host_pgsize] & 1)) &&
+        memcmp(base + offset, zeroes, PGSIZE) != 0;
+      if (save)
+        ppns.push_back(ppn);
+    }
+  }
+
+  uint64_t pages = ppns.size();
+  c.io(pages);
+  if (c.saving()) {
+    for (reg_t ppn : ppns) {
+      c.io(ppn);
+      c.bytes(base + (ppn << PGSHIFT), PGSIZE);
+    }
+  } else {
+    if (!c.incremental)
+      map(true);
+    for (uint64_t i = 0; i < pages; i++) {
+      reg_t ppn;
+      c.io(ppn);
+      if (ppn >= dirty.size())
+        throw std::runtime_error("checkpoint page outside memory");
+      c.bytes(base + (ppn << PGSHIFT), PGSIZE);
+    }
+  }
+  dirty.assign(dirty.size(), false);
+}
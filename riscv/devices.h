@@ -13,6 +13,7 @@
 
 class processor_t;
 class simif_t;
+class abstract_mem_t;
 
 class bus_t : public abstract_device_t {
  public:
@@ -21,9 +22,23 @@ class bus_t : public abstract_device_t {
   void add_device(reg_t addr, abstract_device_t* dev);
 
   std::pair<reg_t, abstract_device_t*> find_device(reg_t addr);
+  // The memory at addr and the offset of addr in it, or NULL if addr isn't
+  // memory
+  abstract_mem_t* find_mem(reg_t addr, reg_t* offset);
 
  private:
-  std::map<reg_t, abstract_device_t*> devices;
+  struct range_t {
+    reg_t base;
+    abstract_device_t* dev;
+    abstract_mem_t* mem; // dev, if it is memory
+  };
+
+  size_t lookup(reg_t addr);
+  bool access(reg_t addr, size_t len, uint8_t* bytes, bool store);
+
+  // Sorted by base address; each device is found for the addresses from its
+  // base up to the next one's
+  std::vector<range_t> devices;
 };
 
 class rom_device_t : public abstract_device_t {
@@ -31,6 +46,7 @@ class rom_device_t : public abstract_device_t {
   rom_device_t(std::vector<char> data);
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
+  bool native_access(reg_t UNUSED addr, size_t UNUSED len) override { return true; }
   const std::vector<char>& contents() { return data; }
  private:
   std::vector<char> data;
@@ -40,9 +56,14 @@ class abstract_mem_t : public abstract_device_t {
  public:
   virtual ~abstract_mem_t() = default;
 
+  bool native_access(reg_t UNUSED addr, size_t UNUSED len) override { return true; }
+
   virtual char* contents(reg_t addr) = 0;
   virtual reg_t size() = 0;
   virtual void dump(std::ostream& o) = 0;
+  // Note that the page holding addr has been written, for the next
+  // incremental checkpoint
+  virtual void mark_dirty(reg_t UNUSED addr) {}
 };
 
 class mem_t : public abstract_mem_t {
@@ -56,11 +77,45 @@ class mem_t : public abstract_mem_t {
   char* contents(reg_t addr) override;
   reg_t size() override { return sz; }
   void dump(std::ostream& o) override;
+  void mark_dirty(reg_t addr) override;
+  void checkpoint(checkpoint_t& c) override;
 
  private:
   bool load_store(reg_t addr, size_t len, uint8_t* bytes, bool store);
 
   std::map<reg_t, char*> sparse_memory_map;
+  std::vector<bool> dirty; // one bit per page, cleared by each checkpoint
+  reg_t sz;
+};
+
+// Memory reserved up front as one anonymous mapping, which the host kernel
+// only populates as pages are touched, so that contents() is an offset from
+// the base rather than a map lookup.
+class flat_mem_t : public abstract_mem_t {
+ public:
+  flat_mem_t(reg_t size, bool hugepages = false);
+  flat_mem_t(const flat_mem_t& that) = delete;
+  ~flat_mem_t() override;
+
+  bool load(reg_t addr, size_t len, uint8_t* bytes) override;
+  bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
+  char* contents(reg_t addr) override { return base + addr; }
+  reg_t size() override { return sz; }
+  void dump(std::ostream& o) override;
+  void mark_dirty(reg_t addr) override;
+  void checkpoint(checkpoint_t& c) override;
+  // Map len bytes of a file, from fileoff, over the memory at addr, to be
+  // read in as they are touched and copied on write.  Both offsets must be
+  // page-aligned; returns false, leaving the memory untouched, if they
+  // aren't or the file can't be mapped.
+  bool map_file(const char* path, reg_t fileoff, reg_t addr, reg_t len);
+
+ private:
+  void map(bool replace);
+
+  char* base;
+  bool hugepages;
+  std::vector<bool> dirty; // one bit per page, cleared by each checkpoint
   reg_t sz;
 };
 
@@ -71,6 +126,7 @@ class clint_t : public abstract_device_t {
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
   size_t size() { return CLINT_SIZE; }
   void tick(reg_t rtc_ticks) override;
+  void checkpoint(checkpoint_t& c) override;
   uint64_t get_mtimecmp(reg_t hartid) { return mtimecmp[hartid]; }
   uint64_t get_mtime() { return mtime; }
  private:
@@ -109,6 +165,7 @@ class plic_t : public abstract_device_t, public abstract_interrupt_controller_t
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
   void set_interrupt_level(uint32_t id, int lvl) override;
+  void checkpoint(checkpoint_t& c) override;
   size_t size() { return PLIC_SIZE; }
  private:
   std::vector<plic_context_t> contexts;
@@ -140,6 +197,7 @@ class ns16550_t : public abstract_device_t {
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
   void tick(reg_t rtc_ticks) override;
+  void checkpoint(checkpoint_t& c) override;
   size_t size() { return NS16550_SIZE; }
  private:
   abstract_interrupt_controller_t *intctrl;
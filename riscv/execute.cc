@@ -3,8 +3,11 @@
 #include "config.h"
 #include "processor.h"
 #include "mmu.h"
+#include "dbt.h"
+#include "bbv.h"
 #include "disasm.h"
 #include "decode_macros.h"
+#include <algorithm>
 #include <cassert>
 
 static void commit_log_reset(processor_t* p)
@@ -155,6 +158,162 @@ inline void processor_t::update_histogram(reg_t pc)
 {
   if (histogram_enabled)
     pc_histogram[pc]++;
+  // off the fast path, each instruction counts as a block of its own
+  if (unlikely(bbv != nullptr))
+    bbv->counts[pc]++;
+}
+
+// Runs pre-decoded entries from `begin` up to, but not including, `end`,
+// or through the first taken branch, and returns the next pc.  The entry it
+// stopped at is left in *stop; anything that can trap points *stop at its
+// own entry first, so the caller knows how far it got.  Loads and stores
+// do not throw their traps but leave them pending in the MMU, and return
+// straight away.
+// Dispatch is threaded: each uop jumps straight to the next one's code.
+// Each case does what the RV64 handlers decode_uop maps onto it do, minus
+// the checks decode_uop hoisted.  A fused case runs its pair in one go,
+// stepping onto the second entry before anything there can trap.
+static NOINLINE reg_t execute_uops(processor_t* p, const icache_entry_t* begin,
+                                   const icache_entry_t* end, const icache_entry_t** stop)
+{
+  static const void* const dispatch[] = {
+    &&uop_NONE,
+    &&uop_ADD, &&uop_SUB, &&uop_SLL, &&uop_SLT, &&uop_SLTU,
+    &&uop_XOR, &&uop_SRL, &&uop_SRA, &&uop_OR, &&uop_AND, &&uop_MUL,
+    &&uop_ADDW, &&uop_SUBW, &&uop_SLLW, &&uop_SRLW, &&uop_SRAW, &&uop_MULW,
+    &&uop_ADDI, &&uop_SLTI, &&uop_SLTIU, &&uop_XORI, &&uop_ORI, &&uop_ANDI,
+    &&uop_SLLI, &&uop_SRLI, &&uop_SRAI,
+    &&uop_ADDIW, &&uop_SLLIW, &&uop_SRLIW, &&uop_SRAIW,
+    &&uop_LI,
+    &&uop_LB, &&uop_LH, &&uop_LW, &&uop_LD, &&uop_LBU, &&uop_LHU, &&uop_LWU,
+    &&uop_SB, &&uop_SH, &&uop_SW, &&uop_SD,
+    &&uop_BEQ, &&uop_BNE, &&uop_BLT, &&uop_BGE, &&uop_BLTU, &&uop_BGEU,
+    &&uop_LI_ADDI, &&uop_LI_ADDIW, &&uop_LI_LW, &&uop_LI_LD,
+    &&uop_SLLI_SRLI, &&uop_SLLI_SRAI,
+    &&uop_SLT_BRANCH, &&uop_SLTU_BRANCH, &&uop_SLTI_BRANCH, &&uop_SLTIU_BRANCH,
+  };
+  static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == UOP_SLTIU_BRANCH + 1);
+
+  auto& x = p->get_state()->XPR;
+  mmu_t& mmu = *p->get_mmu();
+  const icache_entry_t* e = begin;
+
+  #define U (e->uop)
+  #define X_RS1 x[U.rs1]
+  #define X_RS2 x[U.rs2]
+  #define IMM reg_t(U.imm)
+  #define SET_RD(value) x.write(U.rd, value)
+  #define NEXT_UOP \
+    if (++e == end) \
+      goto done; \
+    goto *dispatch[U.exec]
+  #define LOAD(type) { \
+      *stop = e; \
+      type value; \
+      if (unlikely(!mmu.try_load<type>(X_RS1 + IMM, value))) \
+        return 0; \
+      SET_RD(value); \
+      NEXT_UOP; \
+    }
+  #define STORE(type) \
+    *stop = e; \
+    if (unlikely(!mmu.try_store<type>(X_RS1 + IMM, X_RS2))) \
+      return 0; \
+    NEXT_UOP
+  #define BRANCH_IF(cond) \
+    if (cond) \
+      goto taken; \
+    NEXT_UOP
+  // the second half of a pair tests the first half's result against zero
+  #define TEST_AND_BRANCH(value) { \
+      reg_t result = (value); \
+      SET_RD(result); \
+      ++e; \
+      BRANCH_IF((result != 0) == (U.op == UOP_BNE)); \
+    }
+
+  goto *dispatch[U.exec];
+
+  uop_NONE: goto done;
+  uop_ADD: SET_RD(X_RS1 + X_RS2); NEXT_UOP;
+  uop_SUB: SET_RD(X_RS1 - X_RS2); NEXT_UOP;
+  uop_SLL: SET_RD(X_RS1 << (X_RS2 & 63)); NEXT_UOP;
+  uop_SLT: SET_RD(sreg_t(X_RS1) < sreg_t(X_RS2)); NEXT_UOP;
+  uop_SLTU: SET_RD(X_RS1 < X_RS2); NEXT_UOP;
+  uop_XOR: SET_RD(X_RS1 ^ X_RS2); NEXT_UOP;
+  uop_SRL: SET_RD(X_RS1 >> (X_RS2 & 63)); NEXT_UOP;
+  uop_SRA: SET_RD(sreg_t(X_RS1) >> (X_RS2 & 63)); NEXT_UOP;
+  uop_OR: SET_RD(X_RS1 | X_RS2); NEXT_UOP;
+  uop_AND: SET_RD(X_RS1 & X_RS2); NEXT_UOP;
+  uop_MUL: SET_RD(X_RS1 * X_RS2); NEXT_UOP;
+  uop_ADDW: SET_RD(sext32(X_RS1 + X_RS2)); NEXT_UOP;
+  uop_SUBW: SET_RD(sext32(X_RS1 - X_RS2)); NEXT_UOP;
+  uop_SLLW: SET_RD(sext32(X_RS1 << (X_RS2 & 31))); NEXT_UOP;
+  uop_SRLW: SET_RD(sext32((uint32_t)X_RS1 >> (X_RS2 & 31))); NEXT_UOP;
+  uop_SRAW: SET_RD(sext32(int32_t(X_RS1) >> (X_RS2 & 31))); NEXT_UOP;
+  uop_MULW: SET_RD(sext32(X_RS1 * X_RS2)); NEXT_UOP;
+  uop_ADDI: SET_RD(X_RS1 + IMM); NEXT_UOP;
+  uop_SLTI: SET_RD(sreg_t(X_RS1) < sreg_t(IMM)); NEXT_UOP;
+  uop_SLTIU: SET_RD(X_RS1 < IMM); NEXT_UOP;
+  uop_XORI: SET_RD(X_RS1 ^ IMM); NEXT_UOP;
+  uop_ORI: SET_RD(X_RS1 | IMM); NEXT_UOP;
+  uop_ANDI: SET_RD(X_RS1 & IMM); NEXT_UOP;
+  uop_SLLI: SET_RD(X_RS1 << IMM); NEXT_UOP;
+  uop_SRLI: SET_RD(X_RS1 >> IMM); NEXT_UOP;
+  uop_SRAI: SET_RD(sreg_t(X_RS1) >> IMM); NEXT_UOP;
+  uop_ADDIW: SET_RD(sext32(X_RS1 + IMM)); NEXT_UOP;
+  uop_SLLIW: SET_RD(sext32(X_RS1 << IMM)); NEXT_UOP;
+  uop_SRLIW: SET_RD(sext32((uint32_t)X_RS1 >> IMM)); NEXT_UOP;
+  uop_SRAIW: SET_RD(sext32(int32_t(X_RS1) >> IMM)); NEXT_UOP;
+  uop_LI: SET_RD(IMM); NEXT_UOP;
+  uop_LB: LOAD(int8_t);
+  uop_LH: LOAD(int16_t);
+  uop_LW: LOAD(int32_t);
+  uop_LD: LOAD(int64_t);
+  uop_LBU: LOAD(uint8_t);
+  uop_LHU: LOAD(uint16_t);
+  uop_LWU: LOAD(uint32_t);
+  uop_SB: STORE(uint8_t);
+  uop_SH: STORE(uint16_t);
+  uop_SW: STORE(uint32_t);
+  uop_SD: STORE(uint64_t);
+  uop_BEQ: BRANCH_IF(X_RS1 == X_RS2);
+  uop_BNE: BRANCH_IF(X_RS1 != X_RS2);
+  uop_BLT: BRANCH_IF(sreg_t(X_RS1) < sreg_t(X_RS2));
+  uop_BGE: BRANCH_IF(sreg_t(X_RS1) >= sreg_t(X_RS2));
+  uop_BLTU: BRANCH_IF(X_RS1 < X_RS2);
+  uop_BGEU: BRANCH_IF(X_RS1 >= X_RS2);
+
+  uop_LI_ADDI: SET_RD(IMM + e[1].uop.imm); ++e; NEXT_UOP;
+  uop_LI_ADDIW: SET_RD(sext32(IMM + e[1].uop.imm)); ++e; NEXT_UOP;
+  uop_LI_LW: SET_RD(IMM); ++e; LOAD(int32_t);
+  uop_LI_LD: SET_RD(IMM); ++e; LOAD(int64_t);
+  uop_SLLI_SRLI: SET_RD((X_RS1 << IMM) >> e[1].uop.imm); ++e; NEXT_UOP;
+  uop_SLLI_SRAI: SET_RD(sreg_t(X_RS1 << IMM) >> e[1].uop.imm); ++e; NEXT_UOP;
+  uop_SLT_BRANCH: TEST_AND_BRANCH(sreg_t(X_RS1) < sreg_t(X_RS2));
+  uop_SLTU_BRANCH: TEST_AND_BRANCH(X_RS1 < X_RS2);
+  uop_SLTI_BRANCH: TEST_AND_BRANCH(sreg_t(X_RS1) < sreg_t(IMM));
+  uop_SLTIU_BRANCH: TEST_AND_BRANCH(X_RS1 < IMM);
+
+  taken:
+    *stop = e;
+    p->check_pc_alignment(IMM);
+    *stop = e + 1;
+    return IMM;
+  done:
+    *stop = e;
+    return e[-1].npc;
+
+  #undef U
+  #undef X_RS1
+  #undef X_RS2
+  #undef IMM
+  #undef SET_RD
+  #undef NEXT_UOP
+  #undef LOAD
+  #undef STORE
+  #undef BRANCH_IF
+  #undef TEST_AND_BRANCH
 }
 
 // These two functions are expected to be inlined by the compiler separately in
@@ -197,7 +356,10 @@ static inline reg_t execute_insn_logged(processor_t* p, reg_t pc, insn_fetch_t f
   } catch(...) {
     throw;
   }
-  p->update_histogram(pc);
+  // a serializing instruction is run again once the pipeline drains; count
+  // it then
+  if (npc != PC_SERIALIZE_BEFORE)
+    p->update_histogram(pc);
 
   return npc;
 }
@@ -205,7 +367,7 @@ static inline reg_t execute_insn_logged(processor_t* p, reg_t pc, insn_fetch_t f
 bool processor_t::slow_path()
 {
   return debug || state.single_step != state.STEP_NONE || state.debug_mode ||
-         log_commits_enabled || histogram_enabled || in_wfi || check_triggers_icount;
+         log_commits_enabled || in_wfi || check_triggers_icount;
 }
 
 // fetch/decode/execute loop
@@ -224,8 +386,16 @@ void processor_t::step(size_t n)
 
   while (n > 0) {
     size_t instret = 0;
+    // a pass stops short at the next profiling sample or BBV interval
+    size_t limit = unlikely(profiler != nullptr) ? std::min(n, profile_left) : n;
+    if (unlikely(bbv != nullptr))
+      limit = std::min(limit, bbv_left);
     reg_t pc = state.pc;
     mmu_t* _mmu = mmu;
+    // when counting blocks, the block the fast path is in, and instret when
+    // it got there
+    const icache_block_t* visit = nullptr;
+    size_t visit_start = 0;
     state.prv_changed = false;
     state.v_changed = false;
 
@@ -243,6 +413,30 @@ void processor_t::step(size_t n)
         instret++; \
       }
 
+    auto handle_trap = [&](trap_t& t) {
+      take_trap(t, pc);
+      n = instret;
+
+      // If critical error then enter debug mode critical error trigger enabled
+      if (state.critical_error) {
+        if (state.dcsr->read() & DCSR_CETRIG) {
+          enter_debug_mode(DCSR_CAUSE_EXTCAUSE, DCSR_EXTCAUSE_CRITERR);
+        } else {
+          // Handling of critical error is implementation defined
+          // For now just enter debug mode
+          enter_debug_mode(DCSR_CAUSE_HALT, 0);
+        }
+      }
+      // Trigger action takes priority over single step
+      auto match = TM.detect_trap_match(t);
+      if (match.has_value())
+        take_trigger_action(match->action, 0, state.pc, 0);
+      else if (unlikely(state.single_step == state.STEP_STEPPED)) {
+        state.single_step = state.STEP_NONE;
+        enter_debug_mode(DCSR_CAUSE_STEP, 0);
+      }
+    };
+
     try
     {
       take_pending_interrupt();
@@ -252,7 +446,7 @@ void processor_t::step(size_t n)
       if (unlikely(slow_path()))
       {
         // Main simulation loop, slow path.
-        while (instret < n)
+        while (instret < limit)
         {
           if (unlikely(!state.serialized && state.single_step == state.STEP_STEPPED)) {
             state.single_step = state.STEP_NONE;
@@ -299,47 +493,90 @@ void processor_t::step(size_t n)
           }
         }
       }
-      else while (instret < n)
+      else while (instret < limit)
       {
-        // Main simulation loop, fast path.
-        for (auto ic_entry = _mmu->access_icache(pc); ; ) {
-          auto fetch = ic_entry->data;
-          pc = execute_insn_fast(this, pc, fetch);
-          ic_entry = ic_entry->next;
-          if (unlikely(ic_entry->tag != pc))
-            break;
-          if (unlikely(instret + 1 == n))
+        // Main simulation loop, fast path.  Run straight through a cached
+        // block, leaving it only on a control transfer, at its end, or when
+        // the icache is flushed underneath it.
+        auto block = _mmu->access_icache(pc);
+        size_t i = 0;
+        if (unlikely(count_blocks)) {
+          visit = block;
+          visit_start = instret;
+        }
+        if (unlikely(dbt != nullptr)) {
+          if (block->native && instret + block->native_insns < limit) {
+            // the translated prefix stops early, rather than trapping, on
+            // anything it cannot complete; the interpreter resumes there
+            i = block->native();
+            if (i) {
+              instret += i;
+              pc = block->insns[i - 1].npc;
+              state.pc = pc;
+            }
+          } else if (++block->hits == dbt_t::HOT_THRESHOLD) {
+            dbt->translate(block);
+          }
+        }
+        for (;;) {
+          auto& ic_entry = block->insns[i];
+          if (ic_entry.uop.run > 1 && instret + 1 < limit) {
+            // run this stretch of pre-decoded entries in one go, but no
+            // further than the instruction budget allows
+            size_t end = i + std::min<size_t>(ic_entry.uop.run, limit - instret);
+            if (block->insns[end - 1].uop.exec != block->insns[end - 1].uop.op)
+              end--; // leave a fused pair the budget would split to the next step
+            const icache_entry_t* stop;
+            reg_t npc;
+            try {
+              npc = execute_uops(this, &ic_entry, &block->insns[end], &stop);
+            } catch (...) {
+              // retire the entries ahead of the one that trapped
+              if (stop != &ic_entry) {
+                instret += stop - &ic_entry;
+                pc = stop[-1].npc;
+              }
+              throw;
+            }
+            if (unlikely(_mmu->pending_trap.has_value())) {
+              // the same, for a memory trap the executor returned
+              if (stop != &ic_entry) {
+                instret += stop - &ic_entry;
+                pc = stop[-1].npc;
+              }
+              mem_trap_t t = *_mmu->pending_trap;
+              _mmu->pending_trap.reset();
+              handle_trap(t);
+              goto retired;
+            }
+            pc = npc;
+            size_t ran = stop - &ic_entry;
+            i += ran;
+            instret += ran - 1;
+            if (pc != stop[-1].npc)
+              break;
+          } else {
+            pc = execute_insn_fast(this, pc, ic_entry.data);
+            if (unlikely(pc != ic_entry.npc))
+              break;
+            i++;
+          }
+          if (unlikely(i >= block->size || instret + 1 == limit))
             break;
           instret++;
           state.pc = pc;
         }
 
         advance_pc();
+        if (unlikely(visit != nullptr)) {
+          _mmu->count_block_visit(visit, instret - visit_start);
+          visit = nullptr;
+        }
       }
     }
     catch(trap_t& t)
     {
-      take_trap(t, pc);
-      n = instret;
-
-      // If critical error then enter debug mode critical error trigger enabled
-      if (state.critical_error) {
-        if (state.dcsr->read() & DCSR_CETRIG) {
-          enter_debug_mode(DCSR_CAUSE_EXTCAUSE, DCSR_EXTCAUSE_CRITERR);
-        } else {
-          // Handling of critical error is implementation defined
-          // For now just enter debug mode
-          enter_debug_mode(DCSR_CAUSE_HALT, 0);
-        }
-      }
-      // Trigger action takes priority over single step
-      auto match = TM.detect_trap_match(t);
-      if (match.has_value())
-        take_trigger_action(match->action, 0, state.pc, 0);
-      else if (unlikely(state.single_step == state.STEP_STEPPED)) {
-        state.single_step = state.STEP_NONE;
-        enter_debug_mode(DCSR_CAUSE_STEP, 0);
-      }
+      handle_trap(t);
     }
     catch (triggers::matched_t& t)
     {
@@ -363,8 +600,16 @@ void processor_t::step(size_t n)
       // there is activity.
       n = ++instret;
       in_wfi = true;
+      // a visit in progress already covers the WFI
+      if (unlikely(bbv != nullptr && visit == nullptr))
+        bbv->counts[pc]++;
     }
 
+  retired:
+    // a visit cut short by a trap, a wait or serialization
+    if (unlikely(visit != nullptr))
+      _mmu->count_block_visit(visit, instret - visit_start);
+
     if (!(state.mcountinhibit->read() & MCOUNTINHIBIT_IR))
       state.minstret->bump(instret);
 
@@ -372,6 +617,11 @@ void processor_t::step(size_t n)
     if (!(state.mcountinhibit->read() & MCOUNTINHIBIT_CY))
       state.mcycle->bump(instret);
 
+    if (unlikely(profiler != nullptr))
+      profile_retired(instret);
+    if (unlikely(bbv != nullptr))
+      bbv_retired(instret);
+
     n -= instret;
   }
 }
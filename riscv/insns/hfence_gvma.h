@@ -2,3 +2,8 @@ require_extension('H');
 require_novirt();
 require_privilege(get_field(STATE.mstatus->read(), MSTATUS_TVM) ? PRV_M : PRV_S);
 MMU.flush_tlb();
+MMU.flush_walk_cache();
+// the entries are found by guest-virtual address, so rs1's guest-physical
+// address can't narrow the search
+MMU.flush_stlb(true, std::nullopt, std::nullopt,
+               insn.rs2() ? std::optional<reg_t>(RS2) : std::nullopt);
@@ -7,3 +7,7 @@ if (STATE.v) {
   require_privilege(get_field(STATE.mstatus->read(), MSTATUS_TVM) ? PRV_M : PRV_S);
 }
 MMU.flush_tlb();
+MMU.flush_walk_cache();
+MMU.flush_stlb(STATE.v,
+               insn.rs1() ? std::optional<reg_t>(RS1) : std::nullopt,
+               insn.rs2() ? std::optional<reg_t>(RS2) : std::nullopt);
@@ -287,6 +287,7 @@ void sim_t::interactive()
   funcs["untiln"] = &sim_t::interactive_until_noisy;
   funcs["while"] = &sim_t::interactive_until_silent;
   funcs["dump"] = &sim_t::interactive_dumpmems;
+  funcs["fork"] = &sim_t::interactive_fork;
   funcs["quit"] = &sim_t::interactive_quit;
   funcs["q"] = funcs["quit"];
   funcs["help"] = &sim_t::interactive_help;
@@ -391,6 +392,8 @@ void sim_t::interactive_help(const std::string& cmd, const std::vector<std::stri
     "run [count]                     # Resume noisy execution (until CTRL+C, or [count] insns)\n"
     "r [count]                         Alias for run\n"
     "rs [count]                      # Resume silent execution (until CTRL+C, or [count] insns)\n"
+    "fork <file> [opts]              # Fork a copy that runs freely from here, with output to <file>\n"
+    "                                  and [opts] as for --fork-variant\n"
     "quit                            # End the simulation\n"
     "q                                 Alias for quit\n"
     "help                            # This screen!\n"
@@ -427,6 +430,29 @@ void sim_t::interactive_run(const std::string& cmd, const std::vector<std::strin
   if (!noisy) out << ":" << std::endl;
 }
 
+void sim_t::interactive_fork(const std::string& cmd, const std::vector<std::string>& args)
+{
+  if (args.empty())
+    throw trap_interactive();
+
+  std::string variant;
+  for (size_t i = 1; i < args.size(); i++)
+    variant += args[i] + " ";
+
+  std::ostream out(sout_.rdbuf());
+  try {
+    if (fork_child(args[0], variant)) {
+      // leave the debugger to the parent
+      next_interactive_action = [](){};
+      return;
+    }
+  } catch (std::runtime_error& e) {
+    out << e.what() << std::endl;
+    return;
+  }
+  out << "Forked, with output to " << args[0] << std::endl;
+}
+
 void sim_t::interactive_quit(const std::string& cmd, const std::vector<std::string>& args)
 {
   exit(0);
@@ -462,8 +488,7 @@ reg_t sim_t::get_insn(const std::vector<std::string>& args)
   processor_t *p = get_core(args[0]);
   reg_t pc = p->get_state()->pc;
   mmu_t* mmu = p->get_mmu();
-  icache_entry_t* ic_entry = mmu->access_icache(pc);
-  return ic_entry->data.insn.bits();
+  return mmu->load_insn(pc).insn.bits();
 }
 
 void sim_t::interactive_insn(const std::string& cmd, const std::vector<std::string>& args)
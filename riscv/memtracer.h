@@ -3,6 +3,7 @@
 #ifndef _MEMTRACER_H
 #define _MEMTRACER_H
 
+#include <algorithm>
 #include <cstdint>
 #include <string.h>
 #include <vector>
@@ -49,6 +50,10 @@ class memtracer_list_t : public memtracer_t
   {
     list.push_back(h);
   }
+  void unhook(memtracer_t* h)
+  {
+    list.erase(std::remove(list.begin(), list.end(), h), list.end());
+  }
  private:
   std::vector<memtracer_t*> list;
 };
@@ -6,21 +6,27 @@
 #include "simif.h"
 #include "processor.h"
 #include "decode_macros.h"
+#include <algorithm>
+
+std::mutex mmu_t::host_atomic_mutex;
 
 mmu_t::mmu_t(simif_t* sim, endianness_t endianness, processor_t* proc)
- : sim(sim), proc(proc),
+ : sim(sim), proc(proc), histogram(nullptr), bbv(nullptr),
 #ifdef RISCV_ENABLE_DUAL_ENDIAN
   target_big_endian(endianness == endianness_big),
 #endif
   check_triggers_fetch(false),
   check_triggers_load(false),
   check_triggers_store(false),
-  matched_trigger(NULL)
+  matched_trigger(NULL),
+  host_atomics(false)
 {
 #ifndef RISCV_ENABLE_DUAL_ENDIAN
   assert(endianness == endianness_little);
 #endif
   flush_tlb();
+  flush_walk_cache();
+  flush_stlb();
   yield_load_reservation();
 }
 
@@ -30,8 +36,63 @@ mmu_t::~mmu_t()
 
 void mmu_t::flush_icache()
 {
-  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++) {
     icache[i].tag = -1;
+    icache[i].size = 0;
+  }
+}
+
+void mmu_t::set_histogram(std::unordered_map<reg_t, uint64_t>* histogram)
+{
+  fold_block_counts();
+  this->histogram = histogram;
+  reset_block_counts();
+}
+
+void mmu_t::set_bbv(std::unordered_map<reg_t, uint64_t>* bbv)
+{
+  fold_block_counts();
+  this->bbv = bbv;
+  reset_block_counts();
+}
+
+void mmu_t::reset_block_counts()
+{
+  bool counting = histogram || bbv;
+  block_counts.assign(counting ? ICACHE_ENTRIES : 0, block_counts_t{reg_t(-1), {}});
+  // refill every block, so that each has its counts' tag set
+  flush_icache();
+}
+
+void mmu_t::fold_block_counts()
+{
+  for (size_t i = 0; i < block_counts.size(); i++)
+    fold_block_counts(i);
+}
+
+void mmu_t::fold_block_counts(size_t index)
+{
+  // entry k ran on every visit that ended at or after it.  The entries are
+  // still those the counts were taken on, since only a refill replaces
+  // them, and it folds first.
+  block_counts_t& counts = block_counts[index];
+  const icache_block_t& block = icache[index];
+  uint64_t runs = 0, insns = 0;
+  for (size_t k = icache_block_t::MAX_INSNS; k-- > 0; ) {
+    runs += counts.visits[k];
+    insns += runs;
+    if (runs && histogram)
+      (*histogram)[k ? block.insns[k - 1].npc : counts.tag] += runs;
+  }
+  if (insns && bbv)
+    (*bbv)[counts.tag] += insns;
+  // the tag stays, as the block may be visited again before its refill
+  memset(counts.visits, 0, sizeof(counts.visits));
+}
+
+void mmu_t::flush_store_tlb()
+{
+  memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
 }
 
 void mmu_t::flush_tlb()
@@ -39,10 +100,166 @@ void mmu_t::flush_tlb()
   memset(tlb_insn_tag, -1, sizeof(tlb_insn_tag));
   memset(tlb_load_tag, -1, sizeof(tlb_load_tag));
   memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
+  memset(tlb_mmio_load_tag, -1, sizeof(tlb_mmio_load_tag));
+  memset(tlb_mmio_store_tag, -1, sizeof(tlb_mmio_store_tag));
 
   flush_icache();
 }
 
+void mmu_t::flush_walk_cache()
+{
+  for (auto& e : walk_cache)
+    e.level = 0;
+  for (auto& e : g_tlb)
+    e.tag = -1;
+}
+
+bool mmu_t::walk_cache_lookup(bool stage2, reg_t root, int& level, reg_t addr, int idxbits, reg_t& base)
+{
+  // the deepest table wins, as it skips the most PTE reads
+  for (int i = 1; i <= level; i++) {
+    reg_t prefix = addr >> (PGSHIFT + i * idxbits);
+    auto& e = walk_cache[(prefix ^ i) % WALK_CACHE_ENTRIES];
+    if (e.level == i && e.prefix == prefix && e.root == root && e.stage2 == stage2) {
+      level = i - 1;
+      base = e.base;
+      return true;
+    }
+  }
+  return false;
+}
+
+void mmu_t::walk_cache_refill(bool stage2, reg_t root, int level, reg_t addr, int idxbits, reg_t base)
+{
+  reg_t prefix = addr >> (PGSHIFT + level * idxbits);
+  walk_cache[(prefix ^ level) % WALK_CACHE_ENTRIES] = {root, prefix, base, level, stage2};
+}
+
+// stlb_entry_t::context bits; the mode and status bits follow
+static const uint16_t STLB_VALID = 1;
+static const uint16_t STLB_VIRT = 2;
+
+void mmu_t::flush_stlb()
+{
+  for (auto& set : stlb)
+    for (auto& e : set)
+      e.context = 0;
+  memset(stlb_victim, 0, sizeof(stlb_victim));
+  for (auto& e : stlb_superpages)
+    e.context = 0;
+  stlb_superpage_victim = 0;
+}
+
+// the first 4 KiB page of the page that holds vpn, for a page of 1 << shift
+static reg_t page_vpn(reg_t vpn, int shift)
+{
+  return vpn & -(reg_t(1) << (shift - PGSHIFT));
+}
+
+void mmu_t::flush_stlb(bool virt, std::optional<reg_t> vaddr,
+                       std::optional<reg_t> asid, std::optional<reg_t> vmid)
+{
+  bool rv32 = proc->get_const_xlen() == 32;
+  reg_t asid_mask = rv32 ? SATP32_ASID : SATP64_ASID;
+  reg_t vmid_mask = rv32 ? HGATP32_VMID : HGATP64_VMID;
+
+  auto flush = [&](stlb_entry_t& e) {
+    if ((e.context & STLB_VALID) && bool(e.context & STLB_VIRT) == virt
+        && (!vaddr || e.vpn == page_vpn(*vaddr >> PGSHIFT, e.shift))
+        && (!asid || get_field(e.atp, asid_mask) == (*asid & get_field(asid_mask, asid_mask)))
+        && (!vmid || get_field(e.hgatp, vmid_mask) == (*vmid & get_field(vmid_mask, vmid_mask))))
+      e.context = 0;
+  };
+
+  // a fence for one address need only look in that address's set
+  reg_t first = vaddr ? (*vaddr >> PGSHIFT) % STLB_SETS : 0;
+  reg_t last = vaddr ? first : STLB_SETS - 1;
+  for (reg_t i = first; i <= last; i++)
+    for (auto& e : stlb[i])
+      flush(e);
+  for (auto& e : stlb_superpages)
+    flush(e);
+}
+
+uint16_t mmu_t::stlb_context(const mem_access_info_t& access_info)
+{
+  bool virt = access_info.effective_virt;
+  reg_t mode = access_info.effective_priv;
+
+  // These accesses check PTEs in their own ways, and bare translations
+  // have no walk worth saving
+  if (access_info.flags.hlvx || access_info.flags.ss_access || access_info.flags.clean_inval)
+    return 0;
+  if (!virt && decode_vm_info(proc->get_const_xlen(), false, mode, proc->get_state()->satp->readvirt(false)).levels == 0)
+    return 0;
+
+  reg_t hs_status = proc->state.sstatus->readvirt(false);
+  reg_t status = proc->state.sstatus->readvirt(virt);
+  return STLB_VALID | (virt ? STLB_VIRT : 0) | mode << 2
+         | !!(status & MSTATUS_SUM) << 4
+         | !!(hs_status & MSTATUS_MXR) << 5
+         | !!(status & MSTATUS_MXR) << 6
+         | (proc->xlen == 32) << 7;
+}
+
+bool mmu_t::stlb_walk(mem_access_info_t access_info, reg_t& ppage)
+{
+  int page_shift;
+  uint16_t context = stlb_context(access_info);
+  if (!context)
+    return walk(access_info, ppage, page_shift);
+
+  bool virt = access_info.effective_virt;
+  reg_t vpn = access_info.transformed_vaddr >> PGSHIFT;
+  reg_t atp = proc->get_state()->satp->readvirt(virt);
+  reg_t hgatp = virt ? proc->get_state()->hgatp->read() : 0;
+  uint8_t perm = 1 << access_info.type;
+
+  reg_t set = vpn % STLB_SETS;
+  stlb_entry_t* entry = nullptr;
+  for (auto& e : stlb[set]) {
+    if (e.context == context && e.vpn == vpn && e.atp == atp && e.hgatp == hgatp) {
+      entry = &e;
+      break;
+    }
+  }
+  for (size_t i = 0; !entry && i < STLB_SUPERPAGES; i++) {
+    auto& e = stlb_superpages[i];
+    if (e.context == context && e.vpn == page_vpn(vpn, e.shift) && e.atp == atp && e.hgatp == hgatp)
+      entry = &e;
+  }
+
+  if (entry && (entry->perms & perm)) {
+    ppage = entry->ppage + ((vpn - entry->vpn) << PGSHIFT);
+    return true;
+  }
+
+  // a walk for a new access type may also set the PTE's A/D bits
+  if (!walk(access_info, ppage, page_shift))
+    return false;
+
+  reg_t first_vpn = page_vpn(vpn, page_shift);
+  reg_t first_ppage = ppage - ((vpn - first_vpn) << PGSHIFT);
+  if (entry && (entry->shift != page_shift || entry->ppage != first_ppage)) {
+    // the tables changed without a fence; keep only this walk's view
+    entry->context = 0;
+    entry = nullptr;
+  }
+
+  if (!entry) {
+    if (page_shift > PGSHIFT) {
+      entry = &stlb_superpages[stlb_superpage_victim];
+      stlb_superpage_victim = (stlb_superpage_victim + 1) % STLB_SUPERPAGES;
+    } else {
+      entry = &stlb[set][stlb_victim[set]];
+      stlb_victim[set] = (stlb_victim[set] + 1) % STLB_WAYS;
+    }
+    *entry = {first_vpn, first_ppage, atp, hgatp, context, 0, uint8_t(page_shift)};
+  }
+  entry->perms |= perm;
+  return true;
+}
+
 void throw_access_exception(bool virt, reg_t addr, access_type type)
 {
   switch (type) {
@@ -53,19 +270,59 @@ void throw_access_exception(bool virt, reg_t addr, access_type type)
   }
 }
 
-reg_t mmu_t::translate(mem_access_info_t access_info, reg_t len)
+void mmu_t::throw_pending_trap()
+{
+  mem_trap_t t = *pending_trap;
+  pending_trap.reset();
+
+  // rethrow as the specific type, which is what callers catch
+  bool gva = t.has_gva();
+  reg_t tval = t.get_tval(), tval2 = t.get_tval2(), tinst = t.get_tinst();
+  switch (t.cause()) {
+    case CAUSE_MISALIGNED_LOAD: throw trap_load_address_misaligned(gva, tval, tval2, tinst);
+    case CAUSE_MISALIGNED_STORE: throw trap_store_address_misaligned(gva, tval, tval2, tinst);
+    case CAUSE_FETCH_ACCESS: throw trap_instruction_access_fault(gva, tval, tval2, tinst);
+    case CAUSE_LOAD_ACCESS: throw trap_load_access_fault(gva, tval, tval2, tinst);
+    case CAUSE_STORE_ACCESS: throw trap_store_access_fault(gva, tval, tval2, tinst);
+    case CAUSE_FETCH_PAGE_FAULT: throw trap_instruction_page_fault(gva, tval, tval2, tinst);
+    case CAUSE_LOAD_PAGE_FAULT: throw trap_load_page_fault(gva, tval, tval2, tinst);
+    case CAUSE_STORE_PAGE_FAULT: throw trap_store_page_fault(gva, tval, tval2, tinst);
+    default: abort();
+  }
+}
+
+bool mmu_t::try_translate(mem_access_info_t access_info, reg_t len, reg_t& paddr)
 {
   reg_t addr = access_info.transformed_vaddr;
   access_type type = access_info.type;
-  if (!proc)
-    return addr;
+  if (!proc) {
+    paddr = addr;
+    return true;
+  }
 
   bool virt = access_info.effective_virt;
   reg_t mode = (reg_t) access_info.effective_priv;
 
-  reg_t paddr = walk(access_info) | (addr & (PGSIZE-1));
-  if (!pmp_ok(paddr, len, access_info.flags.ss_access ? STORE : type, mode, access_info.flags.hlvx))
-    throw_access_exception(virt, addr, type);
+  reg_t ppage;
+  if (!stlb_walk(access_info, ppage))
+    return false;
+  paddr = ppage | (addr & (PGSIZE-1));
+  if (!pmp_ok(paddr, len, access_info.flags.ss_access ? STORE : type, mode, access_info.flags.hlvx)) {
+    switch (type) {
+      case FETCH: return defer_trap(trap_instruction_access_fault(virt, addr, 0, 0));
+      case LOAD: return defer_trap(trap_load_access_fault(virt, addr, 0, 0));
+      case STORE: return defer_trap(trap_store_access_fault(virt, addr, 0, 0));
+      default: abort();
+    }
+  }
+  return true;
+}
+
+reg_t mmu_t::translate(mem_access_info_t access_info, reg_t len)
+{
+  reg_t paddr;
+  if (!try_translate(access_info, len, paddr))
+    throw_pending_trap();
   return paddr;
 }
 
@@ -149,25 +406,14 @@ bool mmu_t::mmio_store(reg_t paddr, size_t len, const uint8_t* bytes)
 
 bool mmu_t::mmio(reg_t paddr, size_t len, uint8_t* bytes, access_type type)
 {
-  bool power_of_2 = (len & (len - 1)) == 0;
-  bool naturally_aligned = (paddr & (len - 1)) == 0;
-
-  if (power_of_2 && naturally_aligned) {
-    if (!mmio_ok(paddr, type))
-      return false;
-
-    if (type == STORE)
-      return sim->mmio_store(paddr, len, bytes);
-    else
-      return sim->mmio_load(paddr, len, bytes);
-  }
-
-  for (size_t i = 0; i < len; i++) {
-    if (!mmio(paddr + i, 1, bytes + i, type))
-      return false;
-  }
+  // the bus breaks up accesses its devices don't take whole
+  if (!mmio_ok(paddr, type) || !mmio_ok(paddr + len - 1, type))
+    return false;
 
-  return true;
+  if (type == STORE)
+    return sim->mmio_store(paddr, len, bytes);
+  else
+    return sim->mmio_load(paddr, len, bytes);
 }
 
 void mmu_t::check_triggers(triggers::operation_t operation, reg_t address, bool virt, reg_t tval, std::optional<reg_t> data)
@@ -190,7 +436,7 @@ void mmu_t::check_triggers(triggers::operation_t operation, reg_t address, bool
     }
 }
 
-void mmu_t::load_slow_path_intrapage(reg_t len, uint8_t* bytes, mem_access_info_t access_info)
+bool mmu_t::load_slow_path_intrapage(reg_t len, uint8_t* bytes, mem_access_info_t access_info)
 {
   reg_t addr = access_info.vaddr;
   reg_t transformed_addr = access_info.transformed_vaddr;
@@ -198,13 +444,15 @@ void mmu_t::load_slow_path_intrapage(reg_t len, uint8_t* bytes, mem_access_info_
   if (!access_info.flags.is_special_access() && vpn == (tlb_load_tag[vpn % TLB_ENTRIES] & ~TLB_CHECK_TRIGGERS)) {
     auto host_addr = tlb_data[vpn % TLB_ENTRIES].host_offset + transformed_addr;
     memcpy(bytes, host_addr, len);
-    return;
+    return true;
   }
 
-  reg_t paddr = translate(access_info, len);
+  reg_t paddr;
+  if (!try_translate(access_info, len, paddr))
+    return false;
 
   if (access_info.flags.lr && !sim->reservable(paddr)) {
-    throw trap_load_access_fault(access_info.effective_virt, transformed_addr, 0, 0);
+    return defer_trap(trap_load_access_fault(access_info.effective_virt, transformed_addr, 0, 0));
   }
 
   if (auto host_addr = sim->addr_to_mem(paddr)) {
@@ -215,35 +463,49 @@ void mmu_t::load_slow_path_intrapage(reg_t len, uint8_t* bytes, mem_access_info_
       refill_tlb(addr, paddr, host_addr, LOAD);
 
   } else if (!mmio_load(paddr, len, bytes)) {
-    throw trap_load_access_fault(access_info.effective_virt, transformed_addr, 0, 0);
+    return defer_trap(trap_load_access_fault(access_info.effective_virt, transformed_addr, 0, 0));
+  } else if (!access_info.flags.is_special_access()) {
+    refill_mmio_tlb(addr, paddr, LOAD);
   }
 
   if (access_info.flags.lr) {
     load_reservation_address = paddr;
+    memcpy(&load_reservation_value, bytes, len);
   }
+  return true;
 }
 
-void mmu_t::load_slow_path(reg_t original_addr, reg_t len, uint8_t* bytes, xlate_flags_t xlate_flags)
+bool mmu_t::try_load_slow_path(reg_t original_addr, reg_t len, uint8_t* bytes, xlate_flags_t xlate_flags)
 {
+  reg_t vpn = original_addr >> PGSHIFT;
+  if (!xlate_flags.is_special_access() && vpn == tlb_mmio_load_tag[vpn % TLB_ENTRIES] &&
+      ((original_addr & (len - 1)) == 0 || is_misaligned_enabled()) &&
+      original_addr % PGSIZE + len <= PGSIZE &&
+      mmio_load(tlb_mmio_offset[vpn % TLB_ENTRIES] + original_addr, len, bytes))
+    return true;
+
   auto access_info = generate_access_info(original_addr, LOAD, xlate_flags);
   reg_t transformed_addr = access_info.transformed_vaddr;
   check_triggers(triggers::OPERATION_LOAD, transformed_addr, access_info.effective_virt);
 
   if ((transformed_addr & (len - 1)) == 0) {
-    load_slow_path_intrapage(len, bytes, access_info);
+    if (!load_slow_path_intrapage(len, bytes, access_info))
+      return false;
   } else {
     bool gva = access_info.effective_virt;
     if (!is_misaligned_enabled())
-      throw trap_load_address_misaligned(gva, transformed_addr, 0, 0);
+      return defer_trap(trap_load_address_misaligned(gva, transformed_addr, 0, 0));
 
     if (access_info.flags.lr)
-      throw trap_load_access_fault(gva, transformed_addr, 0, 0);
+      return defer_trap(trap_load_access_fault(gva, transformed_addr, 0, 0));
 
     reg_t len_page0 = std::min(len, PGSIZE - transformed_addr % PGSIZE);
-    load_slow_path_intrapage(len_page0, bytes, access_info);
+    if (!load_slow_path_intrapage(len_page0, bytes, access_info))
+      return false;
     if (len_page0 != len) {
       auto tail_access_info = generate_access_info(original_addr + len_page0, LOAD, xlate_flags);
-      load_slow_path_intrapage(len - len_page0, bytes + len_page0, tail_access_info);
+      if (!load_slow_path_intrapage(len - len_page0, bytes + len_page0, tail_access_info))
+        return false;
     }
   }
 
@@ -253,9 +515,16 @@ void mmu_t::load_slow_path(reg_t original_addr, reg_t len, uint8_t* bytes, xlate
     bytes += sizeof(reg_t);
   }
   check_triggers(triggers::OPERATION_LOAD, transformed_addr, access_info.effective_virt, reg_from_bytes(len, bytes));
+  return true;
+}
+
+void mmu_t::load_slow_path(reg_t original_addr, reg_t len, uint8_t* bytes, xlate_flags_t xlate_flags)
+{
+  if (!try_load_slow_path(original_addr, len, bytes, xlate_flags))
+    throw_pending_trap();
 }
 
-void mmu_t::store_slow_path_intrapage(reg_t len, const uint8_t* bytes, mem_access_info_t access_info, bool actually_store)
+bool mmu_t::store_slow_path_intrapage(reg_t len, const uint8_t* bytes, mem_access_info_t access_info, bool actually_store)
 {
   reg_t addr = access_info.vaddr;
   reg_t transformed_addr = access_info.transformed_vaddr;
@@ -265,26 +534,57 @@ void mmu_t::store_slow_path_intrapage(reg_t len, const uint8_t* bytes, mem_acces
       auto host_addr = tlb_data[vpn % TLB_ENTRIES].host_offset + transformed_addr;
       memcpy(host_addr, bytes, len);
     }
-    return;
+    return true;
   }
 
-  reg_t paddr = translate(access_info, len);
+  reg_t paddr;
+  if (!try_translate(access_info, len, paddr))
+    return false;
 
   if (actually_store) {
-    if (auto host_addr = sim->addr_to_mem(paddr)) {
+    if (auto host_addr = sim->addr_to_mem_for_store(paddr)) {
       memcpy(host_addr, bytes, len);
       if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE))
         tracer.trace(paddr, len, STORE);
       else if (!access_info.flags.is_special_access())
         refill_tlb(addr, paddr, host_addr, STORE);
     } else if (!mmio_store(paddr, len, bytes)) {
-      throw trap_store_access_fault(access_info.effective_virt, transformed_addr, 0, 0);
+      return defer_trap(trap_store_access_fault(access_info.effective_virt, transformed_addr, 0, 0));
+    } else if (!access_info.flags.is_special_access()) {
+      refill_mmio_tlb(addr, paddr, STORE);
     }
   }
+  return true;
 }
 
-void mmu_t::store_slow_path(reg_t original_addr, reg_t len, const uint8_t* bytes, xlate_flags_t xlate_flags, bool actually_store, bool UNUSED require_alignment)
+char* mmu_t::host_atomic_addr(reg_t addr, reg_t len)
 {
+  auto access_info = generate_access_info(addr, STORE, {});
+  reg_t transformed_addr = access_info.transformed_vaddr;
+  if (transformed_addr & (len - 1))
+    return nullptr;
+
+  reg_t vpn = transformed_addr >> PGSHIFT;
+  if (vpn == tlb_store_tag[vpn % TLB_ENTRIES])
+    return tlb_data[vpn % TLB_ENTRIES].host_offset + transformed_addr;
+  if (check_triggers_store)
+    return nullptr;
+
+  reg_t paddr = translate(access_info, len);
+  if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE))
+    return nullptr;
+  return sim->addr_to_mem_for_store(paddr);
+}
+
+bool mmu_t::try_store_slow_path(reg_t original_addr, reg_t len, const uint8_t* bytes, xlate_flags_t xlate_flags, bool actually_store, bool require_alignment)
+{
+  reg_t vpn = original_addr >> PGSHIFT;
+  if (actually_store && !xlate_flags.is_special_access() && vpn == tlb_mmio_store_tag[vpn % TLB_ENTRIES] &&
+      ((original_addr & (len - 1)) == 0 || (is_misaligned_enabled() && !require_alignment)) &&
+      original_addr % PGSIZE + len <= PGSIZE &&
+      mmio_store(tlb_mmio_offset[vpn % TLB_ENTRIES] + original_addr, len, bytes))
+    return true;
+
   auto access_info = generate_access_info(original_addr, STORE, xlate_flags);
   reg_t transformed_addr = access_info.transformed_vaddr;
   if (actually_store) {
@@ -301,22 +601,30 @@ void mmu_t::store_slow_path(reg_t original_addr, reg_t len, const uint8_t* bytes
   if (transformed_addr & (len - 1)) {
     bool gva = access_info.effective_virt;
     if (!is_misaligned_enabled())
-      throw trap_store_address_misaligned(gva, transformed_addr, 0, 0);
+      return defer_trap(trap_store_address_misaligned(gva, transformed_addr, 0, 0));
 
     if (require_alignment)
-      throw trap_store_access_fault(gva, transformed_addr, 0, 0);
+      return defer_trap(trap_store_access_fault(gva, transformed_addr, 0, 0));
 
     reg_t len_page0 = std::min(len, PGSIZE - transformed_addr % PGSIZE);
-    store_slow_path_intrapage(len_page0, bytes, access_info, actually_store);
+    if (!store_slow_path_intrapage(len_page0, bytes, access_info, actually_store))
+      return false;
     if (len_page0 != len) {
       auto tail_access_info = generate_access_info(original_addr + len_page0, STORE, xlate_flags);
-      store_slow_path_intrapage(len - len_page0, bytes + len_page0, tail_access_info, actually_store);
+      return store_slow_path_intrapage(len - len_page0, bytes + len_page0, tail_access_info, actually_store);
     }
+    return true;
   } else {
-    store_slow_path_intrapage(len, bytes, access_info, actually_store);
+    return store_slow_path_intrapage(len, bytes, access_info, actually_store);
   }
 }
 
+void mmu_t::store_slow_path(reg_t original_addr, reg_t len, const uint8_t* bytes, xlate_flags_t xlate_flags, bool actually_store, bool require_alignment)
+{
+  if (!try_store_slow_path(original_addr, len, bytes, xlate_flags, actually_store, require_alignment))
+    throw_pending_trap();
+}
+
 tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type)
 {
   reg_t idx = (vaddr >> PGSHIFT) % TLB_ENTRIES;
@@ -349,36 +657,113 @@ tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_
   return entry;
 }
 
-bool mmu_t::pmp_ok(reg_t addr, reg_t len, access_type type, reg_t mode, bool hlvx)
+void mmu_t::refill_mmio_tlb(reg_t vaddr, reg_t paddr, access_type type)
 {
-  if (!proc || proc->n_pmp == 0)
-    return true;
+  reg_t idx = (vaddr >> PGSHIFT) % TLB_ENTRIES;
+  reg_t expected_tag = vaddr >> PGSHIFT;
+  reg_t ppage = paddr & ~reg_t(PGSIZE - 1);
+
+  // Accesses that watch for triggers take the slow path every time, as do
+  // the debug module's pages, which are only open in debug mode
+  bool check_triggers = type == STORE ? check_triggers_store : check_triggers_load;
+  if (in_mprv() || check_triggers ||
+      (ppage <= DEBUG_END && ppage + PGSIZE - 1 >= DEBUG_START) ||
+      !pmp_homogeneous(ppage, PGSIZE))
+    return;
 
-  for (size_t i = 0; i < proc->n_pmp; i++) {
-    // Check each 4-byte sector of the access
-    bool any_match = false;
-    bool all_match = true;
-    for (reg_t offset = 0; offset < len; offset += 1 << PMP_SHIFT) {
-      reg_t cur_addr = addr + offset;
-      bool match = proc->state.pmpaddr[i]->match4(cur_addr);
-      any_match |= match;
-      all_match &= match;
-    }
+  if (tlb_mmio_load_tag[idx] != expected_tag)
+    tlb_mmio_load_tag[idx] = -1;
+  if (tlb_mmio_store_tag[idx] != expected_tag)
+    tlb_mmio_store_tag[idx] = -1;
 
-    if (any_match) {
-      // If the PMP matches only a strict subset of the access, fail it
-      if (!all_match)
-        return false;
+  if (type == STORE)
+    tlb_mmio_store_tag[idx] = expected_tag;
+  else
+    tlb_mmio_load_tag[idx] = expected_tag;
+  tlb_mmio_offset[idx] = paddr - vaddr;
+}
 
-      return proc->state.pmpaddr[i]->access_ok(type, mode, hlvx);
+// The bit of pmp_range_t::perms for an access of the given kind; only M-mode
+// differs from the other modes, and the hlvx flag only matters to loads
+static uint8_t pmp_perm(access_type type, bool m_mode, bool hlvx)
+{
+  int kind = type == FETCH ? 0 : type == STORE ? 1 : hlvx ? 3 : 2;
+  return 1 << (kind + 4 * m_mode);
+}
+
+void mmu_t::build_pmp_map()
+{
+  // Every address between two consecutive bounds matches the same entries
+  std::vector<reg_t> bounds = {0};
+  for (size_t i = 0; i < proc->n_pmp; i++) {
+    reg_t first, last;
+    if (proc->state.pmpaddr[i]->match_range(first, last)) {
+      bounds.push_back(first);
+      if (last + 1 != 0)
+        bounds.push_back(last + 1);
     }
   }
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
 
-  // in case matching region is not found
   const bool mseccfg_mml = proc->state.mseccfg->get_mml();
   const bool mseccfg_mmwp = proc->state.mseccfg->get_mmwp();
-  return ((mode == PRV_M) && !mseccfg_mmwp
-          && (!mseccfg_mml || ((type == LOAD) || (type == STORE))));
+  static const std::pair<access_type, bool> kinds[] = {
+    {FETCH, false}, {STORE, false}, {LOAD, false}, {LOAD, true}
+  };
+
+  pmp_map.clear();
+  for (reg_t base : bounds) {
+    int entry = -1;
+    for (size_t i = 0; i < proc->n_pmp && entry < 0; i++)
+      if (proc->state.pmpaddr[i]->match4(base))
+        entry = i;
+    if (!pmp_map.empty() && pmp_map.back().entry == entry)
+      continue;
+
+    uint8_t perms = 0;
+    for (bool m_mode : {false, true}) {
+      for (auto [type, hlvx] : kinds) {
+        bool ok;
+        if (entry >= 0)
+          ok = proc->state.pmpaddr[entry]->access_ok(type, m_mode ? PRV_M : PRV_S, hlvx);
+        else  // in case matching region is not found
+          ok = m_mode && !mseccfg_mmwp && (!mseccfg_mml || type != FETCH);
+        if (ok)
+          perms |= pmp_perm(type, m_mode, hlvx);
+      }
+    }
+    pmp_map.push_back({base, entry, perms});
+  }
+  pmp_map_valid = true;
+}
+
+const mmu_t::pmp_range_t* mmu_t::pmp_range(reg_t addr)
+{
+  if (unlikely(!pmp_map_valid))
+    build_pmp_map();
+
+  // The first range begins at 0, so some range holds every address
+  auto it = std::upper_bound(pmp_map.begin(), pmp_map.end(), addr,
+    [](reg_t addr, const pmp_range_t& r) { return addr < r.base; });
+  return &*(it - 1);
+}
+
+bool mmu_t::pmp_ok(reg_t addr, reg_t len, access_type type, reg_t mode, bool hlvx)
+{
+  if (!proc || proc->n_pmp == 0)
+    return true;
+
+  // The access is checked a 4-byte sector at a time, the last of which
+  // starts at last_sector.  Entries match whole sectors, so if the sectors
+  // span two ranges, the lower-numbered entry of the two matches only some
+  // of them, and that fails the access.
+  reg_t last_sector = addr + ((len - 1) & -(reg_t(1) << PMP_SHIFT));
+  auto range = pmp_range(addr);
+  if (last_sector != addr && pmp_range(last_sector) != range)
+    return false;
+
+  return range->perms & pmp_perm(type, mode == PRV_M, hlvx);
 }
 
 reg_t mmu_t::pmp_homogeneous(reg_t addr, reg_t len)
@@ -386,17 +771,13 @@ reg_t mmu_t::pmp_homogeneous(reg_t addr, reg_t len)
   if ((addr | len) & (len - 1))
     abort();
 
-  if (!proc)
+  if (!proc || proc->n_pmp == 0)
     return true;
 
-  for (size_t i = 0; i < proc->n_pmp; i++)
-    if (proc->state.pmpaddr[i]->subset_match(addr, len))
-      return false;
-
-  return true;
+  return pmp_range(addr) == pmp_range(addr + len - 1);
 }
 
-reg_t mmu_t::s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_type, bool virt, bool hlvx, bool is_for_vs_pt_addr)
+reg_t mmu_t::s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_type, bool virt, bool hlvx, bool is_for_vs_pt_addr, int* page_shift)
 {
   if (!virt)
     return gpa;
@@ -418,9 +799,27 @@ reg_t mmu_t::s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_ty
   tinst |= ((proc->get_const_xlen() == 64) && (is_for_vs_pt_addr == true)) ? 0x1000 : 0;
   tinst |= ((type == STORE) && (is_for_vs_pt_addr == true)) ? 0x0020 : 0;
 
+  reg_t gvpn = gpa >> PGSHIFT;
+  g_tlb_entry_t& g = g_tlb[gvpn % G_TLB_ENTRIES];
+  if (g.tag == gvpn) {
+    reg_t pte = g.pte;
+    reg_t ad = PTE_A | ((type == STORE) * PTE_D);
+    bool denied = type == FETCH || hlvx ? !(pte & PTE_X) :
+                  type == LOAD          ? !(pte & PTE_R) && !(mxr && (pte & PTE_X)) :
+                                          !((pte & PTE_R) && (pte & PTE_W));
+    // otherwise, the walk raises the fault or sets A/D
+    if (!denied && (pte & ad) == ad) {
+      if (page_shift)
+        *page_shift = std::min(*page_shift, g.shift);
+      return g.ppage | (gpa & (PGSIZE - 1));
+    }
+  }
+
   reg_t base = vm.ptbase;
+  int start = vm.levels - 1;
   if ((gpa & ~maxgpa) == 0) {
-    for (int i = vm.levels - 1; i >= 0; i--) {
+    walk_cache_lookup(true, vm.ptbase, start, gpa, vm.idxbits, base);
+    for (int i = start; i >= 0; i--) {
       int ptshift = i * vm.idxbits;
       int idxbits = (i == (vm.levels - 1)) ? vm.idxbits + vm.widenbits : vm.idxbits;
       reg_t idx = (gpa >> (PGSHIFT + ptshift)) & ((reg_t(1) << idxbits) - 1);
@@ -444,6 +843,8 @@ reg_t mmu_t::s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_ty
         if (pte & (PTE_D | PTE_A | PTE_U | PTE_N | PTE_PBMT))
           break;
         base = ppn << PGSHIFT;
+        if (i > 0)
+          walk_cache_refill(true, vm.ptbase, i, gpa, vm.idxbits, base);
       } else if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W))) {
         break;
       } else if (!(pte & PTE_U)) {
@@ -477,6 +878,12 @@ reg_t mmu_t::s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_ty
         reg_t page_base = ((ppn & ~((reg_t(1) << napot_bits) - 1))
                           | (vpn & ((reg_t(1) << napot_bits) - 1))
                           | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
+        int shift = PGSHIFT + (napot_bits ? napot_bits : ptshift);
+        if (page_shift)
+          *page_shift = std::min(*page_shift, shift);
+        // PBMT is legal only while menvcfg.PBMTE stays set, so isn't cached
+        if (!(pte & PTE_PBMT))
+          g = {gvpn, pte | ad, page_base, shift};
         return page_base | (gpa & page_mask);
       }
     }
@@ -490,7 +897,7 @@ reg_t mmu_t::s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_ty
   }
 }
 
-reg_t mmu_t::walk(mem_access_info_t access_info)
+bool mmu_t::walk(mem_access_info_t access_info, reg_t& ppage, int& page_shift)
 {
   access_type type = access_info.type;
   reg_t addr = access_info.transformed_vaddr;
@@ -509,8 +916,11 @@ reg_t mmu_t::walk(mem_access_info_t access_info)
     type = STORE;
   }
 
-  if (vm.levels == 0)
-    return s2xlate(addr, addr & ((reg_t(2) << (proc->xlen-1))-1), type, type, virt, hlvx, false) & ~page_mask; // zero-extend from xlen
+  if (vm.levels == 0) {
+    page_shift = PGSHIFT;
+    ppage = s2xlate(addr, addr & ((reg_t(2) << (proc->xlen-1))-1), type, type, virt, hlvx, false) & ~page_mask; // zero-extend from xlen
+    return true;
+  }
 
   bool s_mode = mode == PRV_S;
   bool sum = proc->state.sstatus->readvirt(virt) & MSTATUS_SUM;
@@ -523,8 +933,12 @@ reg_t mmu_t::walk(mem_access_info_t access_info)
   if (masked_msbs != 0 && masked_msbs != mask)
     vm.levels = 0;
 
+  // VS-stage tables, whose root is guest-physical, are told from HS ones
+  // by the low bit of the root, which is otherwise clear
   reg_t base = vm.ptbase;
-  for (int i = vm.levels - 1; i >= 0; i--) {
+  int start = vm.levels - 1;
+  walk_cache_lookup(false, vm.ptbase | virt, start, addr, vm.idxbits, base);
+  for (int i = start; i >= 0; i--) {
     int ptshift = i * vm.idxbits;
     reg_t idx = (addr >> (PGSHIFT + ptshift)) & ((1 << vm.idxbits) - 1);
 
@@ -549,6 +963,8 @@ reg_t mmu_t::walk(mem_access_info_t access_info)
       if (pte & (PTE_D | PTE_A | PTE_U | PTE_N | PTE_PBMT))
         break;
       base = ppn << PGSHIFT;
+      if (i > 0)
+        walk_cache_refill(false, vm.ptbase | virt, i, addr, vm.idxbits, base);
     } else if ((pte & PTE_U) ? s_mode && (type == FETCH || !sum) : !s_mode) {
       break;
     } else if (!(pte & PTE_V) ||
@@ -599,14 +1015,16 @@ reg_t mmu_t::walk(mem_access_info_t access_info)
                         | (vpn & ((reg_t(1) << napot_bits) - 1))
                         | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
       reg_t phys = page_base | (addr & page_mask);
-      return s2xlate(addr, phys, type, type, virt, hlvx, false) & ~page_mask;
+      page_shift = PGSHIFT + (napot_bits ? napot_bits : ptshift);
+      ppage = s2xlate(addr, phys, type, type, virt, hlvx, false, &page_shift) & ~page_mask;
+      return true;
     }
   }
 
   switch (type) {
-    case FETCH: throw trap_instruction_page_fault(virt, addr, 0, 0);
-    case LOAD: throw trap_load_page_fault(virt, addr, 0, 0);
-    case STORE: throw trap_store_page_fault(virt, addr, 0, 0);
+    case FETCH: return defer_trap(trap_instruction_page_fault(virt, addr, 0, 0));
+    case LOAD: return defer_trap(trap_load_page_fault(virt, addr, 0, 0));
+    case STORE: return defer_trap(trap_store_page_fault(virt, addr, 0, 0));
     default: abort();
   }
 }
@@ -617,6 +1035,12 @@ void mmu_t::register_memtracer(memtracer_t* t)
   tracer.hook(t);
 }
 
+void mmu_t::unregister_memtracer(memtracer_t* t)
+{
+  flush_tlb();
+  tracer.unhook(t);
+}
+
 reg_t mmu_t::get_pmlen(bool effective_virt, reg_t effective_priv, xlate_flags_t flags) const {
   if (!proc || proc->get_xlen() != 64 || ((proc->state.sstatus->readvirt(false) | proc->state.sstatus->readvirt(effective_virt)) & MSTATUS_MXR) || flags.hlvx)
     return 0;
@@ -12,8 +12,11 @@
 #include "../fesvr/byteorder.h"
 #include "triggers.h"
 #include "cfg.h"
+#include "uop.h"
 #include <stdlib.h>
 #include <vector>
+#include <unordered_map>
+#include <mutex>
 
 // virtual memory configuration
 #define PGSHIFT 12
@@ -28,9 +31,28 @@ struct insn_fetch_t
 };
 
 struct icache_entry_t {
-  reg_t tag;
-  struct icache_entry_t* next;
+  reg_t npc; // PC of the next sequential instruction
   insn_fetch_t data;
+  uop_t uop; // pre-decoded form, if the fast path runs this one inline
+};
+
+// host code for a block prefix; returns how many instructions it retired
+typedef size_t (*native_block_t)();
+
+// a straight-line run of decoded instructions, keyed by its start PC
+struct icache_block_t {
+  static const size_t MAX_INSNS = 16;
+
+  reg_t tag;
+  size_t size; // zeroed on invalidation, which also ends a running block
+
+  // execution count and translation, only maintained when the DBT is on;
+  // kept beside the tag, so invalidation touches one cache line per block
+  uint32_t hits;
+  native_block_t native;
+  size_t native_insns;
+
+  icache_entry_t insns[MAX_INSNS];
 };
 
 struct tlb_entry_t {
@@ -95,6 +117,28 @@ public:
     return from_target(res);
   }
 
+  // As load(), but a page fault, access fault or misaligned access is not
+  // thrown: it is left for the processor to take, and false returned.
+  template<typename T>
+  bool ALWAYS_INLINE try_load(reg_t addr, T& value) {
+    target_endian<T> res;
+    reg_t vpn = addr >> PGSHIFT;
+    bool aligned = (addr & (sizeof(T) - 1)) == 0;
+    bool tlb_hit = tlb_load_tag[vpn % TLB_ENTRIES] == vpn;
+
+    if (likely(aligned && tlb_hit)) {
+      res = *(target_endian<T>*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr);
+    } else if (!try_load_slow_path(addr, sizeof(T), (uint8_t*)&res, {})) {
+      return false;
+    }
+
+    if (unlikely(proc && proc->get_log_commits_enabled()))
+      proc->state.log_mem_read.push_back(std::make_tuple(addr, 0, sizeof(T)));
+
+    value = from_target(res);
+    return true;
+  }
+
   template<typename T>
   T load_reserved(reg_t addr) {
     return load<T>(addr, {.lr = true});
@@ -135,6 +179,26 @@ public:
       proc->state.log_mem_write.push_back(std::make_tuple(addr, val, sizeof(T)));
   }
 
+  // As store(), but returning false, rather than throwing, as try_load does.
+  template<typename T>
+  bool ALWAYS_INLINE try_store(reg_t addr, T val) {
+    reg_t vpn = addr >> PGSHIFT;
+    bool aligned = (addr & (sizeof(T) - 1)) == 0;
+    bool tlb_hit = tlb_store_tag[vpn % TLB_ENTRIES] == vpn;
+
+    if (likely(aligned && tlb_hit)) {
+      *(target_endian<T>*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr) = to_target(val);
+    } else {
+      target_endian<T> target_val = to_target(val);
+      if (!try_store_slow_path(addr, sizeof(T), (const uint8_t*)&target_val, {}, true, false))
+        return false;
+    }
+
+    if (unlikely(proc && proc->get_log_commits_enabled()))
+      proc->state.log_mem_write.push_back(std::make_tuple(addr, val, sizeof(T)));
+    return true;
+  }
+
   template<typename T>
   void guest_store(reg_t addr, T val) {
     store(addr, val, {.forced_virt=true});
@@ -168,6 +232,8 @@ public:
   T amo(reg_t addr, op f) {
     convert_load_traps_to_store_traps({
       store_slow_path(addr, sizeof(T), nullptr, {}, false, true);
+      if (unlikely(host_atomics))
+        return host_amo<T>(addr, [&](T lhs, bool& UNUSED write) { return f(lhs); });
       auto lhs = load<T>(addr);
       store<T>(addr, f(lhs));
       return lhs;
@@ -191,6 +257,8 @@ public:
   T amo_compare_and_swap(reg_t addr, T comp, T swap) {
     convert_load_traps_to_store_traps({
       store_slow_path(addr, sizeof(T), nullptr, {}, false, true);
+      if (unlikely(host_atomics))
+        return host_amo<T>(addr, [&](T lhs, bool& write) { write = lhs == comp; return swap; });
       auto lhs = load<T>(addr);
       if (lhs == comp)
         store<T>(addr, swap);
@@ -270,15 +338,26 @@ public:
   {
     bool have_reservation = check_load_reservation(addr, sizeof(T));
 
-    if (have_reservation)
+    if (have_reservation && unlikely(host_atomics)) {
+      // another thread's hart may have written since the LR, so only
+      // store if the location still holds what the LR read
+      T reserved_bits;
+      memcpy(&reserved_bits, &load_reservation_value, sizeof(T));
+      T reserved = from_target(*(target_endian<T>*)&reserved_bits);
+      host_amo<T>(addr, [&](T lhs, bool& write) {
+        have_reservation = write = lhs == reserved;
+        return val;
+      });
+    } else if (have_reservation) {
       store(addr, val);
+    }
 
     yield_load_reservation();
 
     return have_reservation;
   }
 
-  static const reg_t ICACHE_ENTRIES = 1024;
+  static const reg_t ICACHE_ENTRIES = 512;
 
   inline size_t icache_index(reg_t addr)
   {
@@ -291,12 +370,8 @@ public:
     return from_target(*(target_endian<T>*)(tlb_entry.host_offset + addr));
   }
 
-  inline icache_entry_t* refill_icache(reg_t addr, icache_entry_t* entry)
+  inline insn_fetch_t fetch_insn(reg_t addr, tlb_entry_t tlb_entry)
   {
-    if (matched_trigger)
-      throw *matched_trigger;
-
-    auto tlb_entry = translate_insn_addr(addr);
     insn_bits_t insn = from_le(*(uint16_t*)(tlb_entry.host_offset + addr));
     int length = insn_length(insn);
 
@@ -314,37 +389,134 @@ public:
       insn |= (insn_bits_t)from_le(*(const uint16_t*)translate_insn_addr_to_host(addr + 6)) << 48;
     }
 
-    insn_fetch_t fetch = {proc->decode_insn(insn), insn};
-    entry->tag = addr;
-    entry->next = &icache[icache_index(addr + length)];
-    entry->data = fetch;
+    return {proc->decode_insn(insn), insn};
+  }
+
+  // unconditional jumps end a block, since nothing after them falls through
+  static bool ends_block(insn_t insn)
+  {
+    insn_bits_t bits = insn.bits();
+    if (insn.length() == 2) {
+      bool c_j = (bits & 0xe003) == 0xa001;
+      bool c_jr = (bits & 0xf07f) == 0x8002 && (bits & 0x0f80) != 0;
+      bool c_jalr = (bits & 0xf07f) == 0x9002 && (bits & 0x0f80) != 0;
+      return c_j || c_jr || c_jalr;
+    }
+    return (bits & 0x7f) == 0x6f || (bits & 0x707f) == 0x67;
+  }
+
+  inline icache_block_t* refill_icache(reg_t addr, icache_block_t* block)
+  {
+    if (matched_trigger)
+      throw *matched_trigger;
+
+    if (unlikely(!block_counts.empty()))
+      fold_block_counts(block - icache);
+
+    block->tag = -1;
+    block->size = 0;
+    block->hits = 0;
+    block->native = nullptr;
 
-    reg_t paddr = tlb_entry.target_offset + addr;;
-    if (tracer.interested_in_range(paddr, paddr + 1, FETCH)) {
-      entry->tag = -1;
-      tracer.trace(paddr, length, FETCH);
+    // Only the first instruction may take a fetch fault.  Later ones are
+    // decoded ahead only from a RAM page already held in the ITLB, and only
+    // if they lie entirely within that page.
+    auto tlb_entry = translate_insn_addr(addr);
+    reg_t paddr = tlb_entry.target_offset + addr;
+    reg_t vpn = addr >> PGSHIFT;
+    bool traced = tracer.interested_in_range(paddr, paddr + 1, FETCH);
+    bool cacheable = tlb_insn_tag[vpn % TLB_ENTRIES] == vpn;
+    reg_t page_end = (addr | (PGSIZE - 1)) + 1;
+    size_t max_insns = traced || !cacheable ? 1 : icache_block_t::MAX_INSNS;
+
+    reg_t pc = addr;
+    do {
+      insn_fetch_t fetch = fetch_insn(pc, tlb_entry);
+      reg_t npc = pc + fetch.insn.length();
+      block->insns[block->size++] = {npc, fetch, decode_uop(proc, fetch, pc)};
+      if (ends_block(fetch.insn))
+        break;
+      pc = npc;
+    } while (block->size < max_insns && pc + MAX_INSN_LENGTH <= page_end);
+
+    // fuse the idioms compilers emit back to back, then tell the fast
+    // path how long a run of pre-decoded entries each entry starts
+    for (size_t i = 1; i < block->size; i++) {
+      if (fuse_uop(block->insns[i - 1].uop, block->insns[i].uop))
+        i++;
+    }
+    for (size_t i = block->size - 1; i-- > 0; ) {
+      uop_t& uop = block->insns[i].uop;
+      if (uop.run)
+        uop.run += block->insns[i + 1].uop.run;
     }
-    return entry;
+
+    if (traced)
+      tracer.trace(paddr, block->insns[0].npc - addr, FETCH);
+    else
+      block->tag = addr;
+    if (unlikely(!block_counts.empty()))
+      block_counts[block - icache].tag = addr;
+    return block;
   }
 
-  inline icache_entry_t* access_icache(reg_t addr)
+  inline icache_block_t* access_icache(reg_t addr)
   {
-    icache_entry_t* entry = &icache[icache_index(addr)];
-    if (likely(entry->tag == addr))
-      return entry;
-    return refill_icache(addr, entry);
+    icache_block_t* block = &icache[icache_index(addr)];
+    if (likely(block->tag == addr))
+      return block;
+    return refill_icache(addr, block);
   }
 
   inline insn_fetch_t load_insn(reg_t addr)
   {
-    icache_entry_t entry;
-    return refill_icache(addr, &entry)->data;
+    if (matched_trigger)
+      throw *matched_trigger;
+
+    auto tlb_entry = translate_insn_addr(addr);
+    insn_fetch_t fetch = fetch_insn(addr, tlb_entry);
+
+    reg_t paddr = tlb_entry.target_offset + addr;
+    if (tracer.interested_in_range(paddr, paddr + 1, FETCH))
+      tracer.trace(paddr, fetch.insn.length(), FETCH);
+    return fetch;
   }
 
   void flush_tlb();
+  // the cached page-table entries, which survive flush_tlb(), as they only
+  // go stale on an SFENCE/HFENCE or a new root
+  void flush_walk_cache();
+  // The second-level TLB's translations, which also survive flush_tlb():
+  // all of them, or those made for virt (or not) that match each address,
+  // ASID and VMID given
+  void flush_stlb();
+  void flush_stlb(bool virt, std::optional<reg_t> vaddr,
+                  std::optional<reg_t> asid, std::optional<reg_t> vmid = std::nullopt);
+  // the PMP configuration changed, so pmp_map must be rebuilt, and the
+  // PTE reads the walk cache saved must be checked again
+  void pmp_changed() { pmp_map_valid = false; flush_walk_cache(); flush_stlb(); }
+  // only the store translations, so that each page's next store takes the
+  // slow path; see simif_t::addr_to_mem_for_store
+  void flush_store_tlb();
   void flush_icache();
 
+  // With a PC histogram attached, the fast path counts visits to icache
+  // blocks rather than instructions, and a block's counts are only added to
+  // the histogram when it is refilled, or by fold_block_counts().
+  void set_histogram(std::unordered_map<reg_t, uint64_t>* histogram);
+  // The same for basic-block vectors, which count the instructions each
+  // block retired by the block's first PC
+  void set_bbv(std::unordered_map<reg_t, uint64_t>* bbv);
+  void fold_block_counts();
+  // a visit to block retired its first n entries
+  void count_block_visit(const icache_block_t* block, size_t n)
+  {
+    if (n)
+      block_counts[block - icache].visits[n - 1]++;
+  }
+
   void register_memtracer(memtracer_t*);
+  void unregister_memtracer(memtracer_t*);
 
   int is_misaligned_enabled()
   {
@@ -371,16 +543,74 @@ public:
     blocksz = size;
   }
 
+  // Make AMOs and SCs atomic with respect to harts running on other host
+  // threads, rather than relying on harts taking turns.
+  void set_host_atomics(bool value)
+  {
+    host_atomics = value;
+  }
+
 private:
   simif_t* sim;
   processor_t* proc;
   memtracer_list_t tracer;
   reg_t load_reservation_address;
+  uint64_t load_reservation_value; // as the LR read it, in target byte order
+
+  // Host address of an aligned RAM location this hart may store to, or
+  // nullptr if the access has to take the ordinary load and store paths.
+  char* host_atomic_addr(reg_t addr, reg_t len);
+
+  // Atomically replaces the value at addr with f(old value), unless f
+  // clears its `write` argument, and returns the old value.  Locations
+  // without a host address, and those too wide for host atomics, are
+  // updated under a lock shared by all harts.
+  template<typename T, typename op>
+  T host_amo(reg_t addr, op f) {
+    char* host = host_atomic_addr(addr, sizeof(T));
+    if constexpr (sizeof(T) <= sizeof(uint64_t)) {
+      if (host) {
+        // operate on the raw target-endian bits
+        auto p = (T*)host;
+        T old_bits = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+        for (;;) {
+          bool write = true;
+          T lhs = from_target(*(target_endian<T>*)&old_bits);
+          target_endian<T> new_val = to_target<T>(f(lhs, write));
+          T new_bits = *(T*)&new_val;
+          if (!write || __atomic_compare_exchange_n(p, &old_bits, new_bits, false,
+                                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return lhs;
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(host_atomic_mutex);
+    bool write = true;
+    auto lhs = load<T>(addr);
+    T rhs = f(lhs, write);
+    if (write)
+      store<T>(addr, rhs);
+    return lhs;
+  }
+  static std::mutex host_atomic_mutex;
   uint16_t fetch_temp;
   reg_t blocksz;
 
-  // implement an instruction cache for simulator performance
-  icache_entry_t icache[ICACHE_ENTRIES];
+  // implement an instruction cache of decoded blocks for simulator performance
+  icache_block_t icache[ICACHE_ENTRIES];
+
+  // visits[k] counts the visits to the block that ended after entry k; the
+  // tag is that of the block the counts belong to, or -1 if none
+  struct block_counts_t {
+    reg_t tag;
+    uint64_t visits[icache_block_t::MAX_INSNS];
+  };
+  std::unordered_map<reg_t, uint64_t>* histogram;
+  std::unordered_map<reg_t, uint64_t>* bbv;
+  std::vector<block_counts_t> block_counts; // parallel to icache, if either
+  void fold_block_counts(size_t index);
+  void reset_block_counts();
 
   // implement a TLB for simulator performance
   static const reg_t TLB_ENTRIES = 256;
@@ -391,23 +621,100 @@ private:
   reg_t tlb_insn_tag[TLB_ENTRIES];
   reg_t tlb_load_tag[TLB_ENTRIES];
   reg_t tlb_store_tag[TLB_ENTRIES];
+  // The same for device pages, which have no host address: a hit skips
+  // translation and the PMP check, and goes straight to the bus at
+  // tlb_mmio_offset + vaddr
+  reg_t tlb_mmio_load_tag[TLB_ENTRIES];
+  reg_t tlb_mmio_store_tag[TLB_ENTRIES];
+  reg_t tlb_mmio_offset[TLB_ENTRIES];
+
+  // A page-walk cache of non-leaf PTEs: each entry gives the table at
+  // level-1 that a walk from root reaches for addresses whose bits above
+  // level's index are prefix.  stage2 walks (from hgatp) have their own.
+  struct walk_cache_entry_t {
+    reg_t root;
+    reg_t prefix;
+    reg_t base;
+    int level;  // 0 for an empty entry
+    bool stage2;
+  };
+  static const reg_t WALK_CACHE_ENTRIES = 64;
+  walk_cache_entry_t walk_cache[WALK_CACHE_ENTRIES];
+  bool walk_cache_lookup(bool stage2, reg_t root, int& level, reg_t addr, int idxbits, reg_t& base);
+  void walk_cache_refill(bool stage2, reg_t root, int level, reg_t addr, int idxbits, reg_t base);
+
+  // The second-level TLB: a set-associative cache of walk() results, kept
+  // behind the direct-mapped TLB above.  Each entry is tagged with the
+  // context of its walk (the root, ASID and VMID, the mode, and the
+  // status bits that decide permissions), so it outlives privilege
+  // changes and context switches, and notes each access type that the
+  // walk allowed.  Fences drop only the entries they match.
+  struct stlb_entry_t {
+    reg_t vpn;       // of the page's first 4 KiB
+    reg_t ppage;
+    reg_t atp;       // satp, or vsatp for virt
+    reg_t hgatp;     // for virt, else 0
+    uint16_t context;  // stlb_context(), or 0 for an empty entry
+    uint8_t perms;   // 1 << access_type for each type allowed
+    uint8_t shift;   // log2 of the page size
+  };
+  static const reg_t STLB_SETS = 256;
+  static const reg_t STLB_WAYS = 4;
+  stlb_entry_t stlb[STLB_SETS][STLB_WAYS];
+  uint8_t stlb_victim[STLB_SETS];
+  // Superpages (megapages, gigapages and Svnapot ranges) are kept whole in
+  // a small fully-associative array beside the sets, so that one walk
+  // serves all of a superpage's 4 KiB pages
+  static const reg_t STLB_SUPERPAGES = 16;
+  stlb_entry_t stlb_superpages[STLB_SUPERPAGES];
+  unsigned stlb_superpage_victim;
+  uint16_t stlb_context(const mem_access_info_t& access_info);
+  // walk(), unless the second-level TLB already holds its result
+  bool stlb_walk(mem_access_info_t access_info, reg_t& ppage);
+
+  // The G-stage leaf translations of guest-physical pages, with their PTEs
+  // so that each access can check its own permissions
+  struct g_tlb_entry_t {
+    reg_t tag;
+    reg_t pte;
+    reg_t ppage;
+    int shift;  // log2 of the size of the page it lies in
+  };
+  static const reg_t G_TLB_ENTRIES = 256;
+  g_tlb_entry_t g_tlb[G_TLB_ENTRIES];
 
   // finish translation on a TLB miss and update the TLB
   tlb_entry_t refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type);
+  void refill_mmio_tlb(reg_t vaddr, reg_t paddr, access_type type);
   const char* fill_from_mmio(reg_t vaddr, reg_t paddr);
 
-  // perform a stage2 translation for a given guest address
-  reg_t s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_type, bool virt, bool hlvx, bool is_for_vs_pt_addr);
+  // perform a stage2 translation for a given guest address, lowering
+  // page_shift, if given, to the log2 size of the G-stage page
+  reg_t s2xlate(reg_t gva, reg_t gpa, access_type type, access_type trap_type, bool virt, bool hlvx, bool is_for_vs_pt_addr, int* page_shift = nullptr);
 
-  // perform a page table walk for a given VA; set referenced/dirty bits
-  reg_t walk(mem_access_info_t access_info);
+  // perform a page table walk for a given VA; set referenced/dirty bits.
+  // page_shift is the log2 size of the page that maps it.
+  bool walk(mem_access_info_t access_info, reg_t& ppage, int& page_shift);
+
+  // The common memory traps -- page faults, access faults and misaligned
+  // accesses -- are not thrown where they are detected.  They are left in
+  // pending_trap, and the failure returned up to the public entry points,
+  // which either throw it or, for try_load and try_store, hand it back.
+  std::optional<mem_trap_t> pending_trap;
+  bool defer_trap(const mem_trap_t& t) {
+    pending_trap.emplace(t);
+    return false;
+  }
+  [[noreturn]] void throw_pending_trap();
 
   // handle uncommon cases: TLB misses, page faults, MMIO
   tlb_entry_t fetch_slow_path(reg_t addr);
   void load_slow_path(reg_t original_addr, reg_t len, uint8_t* bytes, xlate_flags_t xlate_flags);
-  void load_slow_path_intrapage(reg_t len, uint8_t* bytes, mem_access_info_t access_info);
+  bool try_load_slow_path(reg_t original_addr, reg_t len, uint8_t* bytes, xlate_flags_t xlate_flags);
+  bool load_slow_path_intrapage(reg_t len, uint8_t* bytes, mem_access_info_t access_info);
   void store_slow_path(reg_t original_addr, reg_t len, const uint8_t* bytes, xlate_flags_t xlate_flags, bool actually_store, bool require_alignment);
-  void store_slow_path_intrapage(reg_t len, const uint8_t* bytes, mem_access_info_t access_info, bool actually_store);
+  bool try_store_slow_path(reg_t original_addr, reg_t len, const uint8_t* bytes, xlate_flags_t xlate_flags, bool actually_store, bool require_alignment);
+  bool store_slow_path_intrapage(reg_t len, const uint8_t* bytes, mem_access_info_t access_info, bool actually_store);
   bool mmio_fetch(reg_t paddr, size_t len, uint8_t* bytes);
   bool mmio_load(reg_t paddr, size_t len, uint8_t* bytes);
   bool mmio_store(reg_t paddr, size_t len, const uint8_t* bytes);
@@ -418,6 +725,7 @@ private:
   }
   void check_triggers(triggers::operation_t operation, reg_t address, bool virt, reg_t tval, std::optional<reg_t> data);
   reg_t translate(mem_access_info_t access_info, reg_t len);
+  bool try_translate(mem_access_info_t access_info, reg_t len, reg_t& paddr);
 
   reg_t pte_load(reg_t pte_paddr, reg_t addr, bool virt, access_type trap_type, size_t ptesize) {
     if (ptesize == 4)
@@ -457,7 +765,7 @@ private:
     if (!pmp_ok(pte_paddr, ptesize, STORE, PRV_S, false))
       throw_access_exception(virt, addr, trap_type);
 
-    void* host_pte_addr = sim->addr_to_mem(pte_paddr);
+    void* host_pte_addr = sim->addr_to_mem_for_store(pte_paddr);
     target_endian<T> target_pte = to_target((T)new_pte);
     if (host_pte_addr) {
       memcpy(host_pte_addr, &target_pte, ptesize);
@@ -489,6 +797,19 @@ private:
   reg_t pmp_homogeneous(reg_t addr, reg_t len);
   bool pmp_ok(reg_t addr, reg_t len, access_type type, reg_t mode, bool hlvx);
 
+  // The PMP entries compiled into ranges of physical addresses, sorted by
+  // base, that each have one deciding entry (or none); adjacent ranges
+  // always differ in entry.  Rebuilt on first use after pmp_changed().
+  struct pmp_range_t {
+    reg_t base;     // the range ends where the next one begins
+    int entry;      // the lowest-numbered matching entry, or -1
+    uint8_t perms;  // whether each pmp_perm() kind of access is allowed
+  };
+  std::vector<pmp_range_t> pmp_map;
+  bool pmp_map_valid = false;
+  void build_pmp_map();
+  const pmp_range_t* pmp_range(reg_t addr);
+
 #ifdef RISCV_ENABLE_DUAL_ENDIAN
   bool target_big_endian;
 #else
@@ -500,7 +821,10 @@ private:
   // The exception describing a matched trigger, or NULL.
   triggers::matched_t *matched_trigger;
 
+  bool host_atomics;
+
   friend class processor_t;
+  friend class dbt_t;
 };
 
 struct vm_info {
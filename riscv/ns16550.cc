@@ -6,6 +6,7 @@
 #include "term.h"
 #include "sim.h"
 #include "dts.h"
+#include "checkpoint.h"
 
 #define UART_QUEUE_SIZE         64
 
@@ -348,6 +349,29 @@ std::string ns16550_generate_dts(const sim_t* sim, const std::vector<std::string
   return s.str();
 }
 
+void ns16550_t::checkpoint(checkpoint_t& c)
+{
+  c.section("ns16550");
+  std::vector<uint8_t> rx;
+  for (; !rx_queue.empty(); rx_queue.pop())
+    rx.push_back(rx_queue.front());
+  c.io(rx);
+  for (auto byte : rx)
+    rx_queue.push(byte);
+
+  c.io(dll);
+  c.io(dlm);
+  c.io(iir);
+  c.io(ier);
+  c.io(fcr);
+  c.io(lcr);
+  c.io(mcr);
+  c.io(lsr);
+  c.io(msr);
+  c.io(scr);
+  c.io(backoff_counter);
+}
+
 ns16550_t* ns16550_parse_from_fdt(const void* fdt, const sim_t* sim, reg_t* base, const std::vector<std::string>& UNUSED sargs)
 {
   uint32_t ns16550_shift, ns16550_io_width, ns16550_int_id;
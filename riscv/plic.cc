@@ -5,6 +5,7 @@
 #include "simif.h"
 #include "sim.h"
 #include "dts.h"
+#include "checkpoint.h"
 
 #define PLIC_MAX_CONTEXTS 15872
 
@@ -424,6 +425,21 @@ std::string plic_generate_dts(const sim_t* sim, const std::vector<std::string>&
   return s.str();
 }
 
+void plic_t::checkpoint(checkpoint_t& c)
+{
+  c.section("plic");
+  c.expect(contexts.size(), "PLIC contexts");
+  c.io(priority);
+  c.io(level);
+  for (auto& context : contexts) {
+    c.io(context.priority_threshold);
+    c.io(context.enable);
+    c.io(context.pending);
+    c.io(context.pending_priority);
+    c.io(context.claimed);
+  }
+}
+
 plic_t* plic_parse_from_fdt(const void* fdt, const sim_t* sim, reg_t* base, const std::vector<std::string>& UNUSED sargs)
 {
   uint32_t plic_ndev;
@@ -8,6 +8,10 @@
 #include "decode_macros.h"
 #include "simif.h"
 #include "mmu.h"
+#include "dbt.h"
+#include "profiler.h"
+#include "bbv.h"
+#include "checkpoint.h"
 #include "disasm.h"
 #include "platform.h"
 #include "vector_unit.h"
@@ -22,6 +26,8 @@
 #include <stdexcept>
 #include <string>
 #include <algorithm>
+#include <map>
+#include <set>
 
 #ifdef __GNUC__
 # pragma GCC diagnostic ignored "-Wunused-variable"
@@ -34,8 +40,8 @@ processor_t::processor_t(const char* isa_str, const char* priv_str,
                          const cfg_t *cfg,
                          simif_t* sim, uint32_t id, bool halt_on_reset,
                          FILE* log_file, std::ostream& sout_)
-: debug(false), halt_request(HR_NONE), isa(isa_str, priv_str), cfg(cfg), sim(sim), id(id), xlen(0),
-  histogram_enabled(false), log_commits_enabled(false),
+: debug(false), halt_request(HR_NONE), isa(isa_str, priv_str), cfg(cfg), sim(sim), dbt(nullptr), profiler(nullptr), profile_left(0), bbv(nullptr), bbv_left(0), id(id), xlen(0),
+  histogram_enabled(false), count_blocks(false), log_commits_enabled(false),
   log_file(log_file), sout_(sout_.rdbuf()), halt_on_reset(halt_on_reset),
   in_wfi(false), check_triggers_icount(false),
   impl_table(256, false), extension_enable_table(isa.get_extension_table()),
@@ -86,15 +92,31 @@ processor_t::~processor_t()
 {
   if (histogram_enabled)
   {
+    mmu->fold_block_counts();
     std::vector<std::pair<reg_t, uint64_t>> ordered_histo(pc_histogram.begin(), pc_histogram.end());
     std::sort(ordered_histo.begin(), ordered_histo.end(),
               [](auto& lhs, auto& rhs) { return lhs.second < rhs.second; });
 
     fprintf(stderr, "PC Histogram size:%zu\n", ordered_histo.size());
-    for (auto it : ordered_histo)
-      fprintf(stderr, "%0" PRIx64 " %" PRIu64 "\n", it.first, it.second);
+    for (auto it : ordered_histo) {
+      uint64_t offset;
+      const char* sym = get_symbol(it.first, &offset);
+      if (sym)
+        fprintf(stderr, "%0" PRIx64 " %" PRIu64 " %s+0x%" PRIx64 "\n", it.first, it.second, sym, offset);
+      else
+        fprintf(stderr, "%0" PRIx64 " %" PRIu64 "\n", it.first, it.second);
+    }
   }
 
+  if (profiler)
+    profiler->report(stderr);
+
+  if (bbv)
+    mmu->fold_block_counts();
+
+  delete profiler;
+  delete bbv;
+  delete dbt;
   delete mmu;
   delete disassembler;
 }
@@ -164,6 +186,33 @@ void state_t::reset(processor_t* const proc, reg_t max_isa)
   csr_init(proc, max_isa);
 }
 
+void state_t::checkpoint(checkpoint_t& c)
+{
+  c.io(pc);
+  c.io(XPR);
+  c.io(FPR);
+  c.io(prv);
+  c.io(prev_prv);
+  c.io(v);
+  c.io(prev_v);
+  c.io(serialized);
+  c.io(debug_mode);
+  c.io(single_step);
+  c.io(elp);
+  c.io(critical_error);
+
+  // in address order, so that the restore walks the CSRs as the save did;
+  // a CSR can appear at more than one address
+  std::map<reg_t, csr_t*> csrs;
+  for (auto& [addr, csr] : csrmap)
+    csrs[addr] = csr.get();
+  c.expect(csrs.size(), "CSR count");
+  std::set<csr_t*> done;
+  for (auto& [addr, csr] : csrs)
+    if (done.insert(csr).second)
+      csr->checkpoint(c);
+}
+
 void processor_t::set_debug(bool value)
 {
   debug = value;
@@ -175,6 +224,57 @@ void processor_t::set_debug(bool value)
 void processor_t::set_histogram(bool value)
 {
   histogram_enabled = value;
+  count_blocks = histogram_enabled || bbv;
+  mmu->set_histogram(value ? &pc_histogram : nullptr);
+}
+
+void processor_t::set_dbt(bool value)
+{
+  delete dbt;
+  dbt = value ? new dbt_t(this) : nullptr;
+  mmu->flush_icache();
+}
+
+void processor_t::set_profile(size_t period)
+{
+  delete profiler;
+  profiler = period ? new profiler_t(this, sim, period) : nullptr;
+  profile_left = period;
+}
+
+void processor_t::set_bbv(const std::string& path, size_t interval)
+{
+  mmu->set_bbv(nullptr);
+  delete bbv;
+  bbv = interval ? new bbv_t(path, interval) : nullptr;
+  bbv_left = interval;
+  count_blocks = histogram_enabled || bbv;
+  mmu->set_bbv(bbv ? &bbv->counts : nullptr);
+}
+
+void processor_t::bbv_retired(reg_t n)
+{
+  // steps stop at the end of an interval, so n never runs past it
+  bbv_left -= n;
+  if (bbv_left == 0) {
+    mmu->fold_block_counts();
+    bbv->end_interval();
+    bbv_left = bbv->interval;
+  }
+}
+
+void processor_t::profile_retired(reg_t n)
+{
+  if (n < profile_left) {
+    profile_left -= n;
+    return;
+  }
+
+  // n spans more than one period only when idle time was skipped, during
+  // which the PC stood still
+  n -= profile_left;
+  profiler->sample(1 + n / profiler->period);
+  profile_left = profiler->period - n % profiler->period;
 }
 
 void processor_t::enable_log_commits()
@@ -186,6 +286,7 @@ void processor_t::reset()
 {
   xlen = isa.get_max_xlen();
   state.reset(this, isa.get_max_isa());
+  mmu->pmp_changed();
   if (any_vector_extensions())
     VU.reset();
   in_wfi = false;
@@ -207,6 +308,28 @@ void processor_t::reset()
     sim->proc_reset(id);
 }
 
+void processor_t::checkpoint(checkpoint_t& c)
+{
+  c.section("hart");
+  c.expect(id, "hart IDs");
+  c.expect(isa.get_isa_string(), "ISA");
+  state.checkpoint(c);
+  // misa writes keep this in step with misa, which was restored as is
+  c.io(extension_enable_table);
+  c.io(in_wfi);
+  c.io(halt_request);
+  if (any_vector_extensions())
+    VU.checkpoint(c);
+  TM.checkpoint(c);
+  c.io(mmu->load_reservation_address);
+
+  if (!c.saving()) {
+    mmu->pmp_changed();
+    mmu->flush_tlb();
+    mmu->flush_icache();
+  }
+}
+
 extension_t* processor_t::get_extension()
 {
   switch (custom_extensions.size()) {
@@ -276,6 +399,24 @@ void processor_t::set_mmu_capability(int cap)
   }
 }
 
+void processor_t::skip_wfi_steps(reg_t n)
+{
+  // each such step retires the waiting instruction again
+  if (!(state.mcountinhibit->read() & MCOUNTINHIBIT_IR))
+    state.minstret->bump(n);
+  if (!(state.mcountinhibit->read() & MCOUNTINHIBIT_CY))
+    state.mcycle->bump(n);
+  if (profiler)
+    profile_retired(n);
+  // counted against the waiting instruction, an interval at a time
+  for (reg_t left = n; bbv && left > 0; ) {
+    reg_t slice = std::min<reg_t>(left, bbv_left);
+    bbv->counts[state.pc] += slice;
+    bbv_retired(slice);
+    left -= slice;
+  }
+}
+
 void processor_t::take_interrupt(reg_t pending_interrupts)
 {
   // Do nothing if no pending interrupts
@@ -353,11 +494,20 @@ reg_t processor_t::legalize_privilege(reg_t prv)
 
 void processor_t::set_privilege(reg_t prv, bool virt)
 {
-  mmu->flush_tlb();
+  reg_t new_prv = legalize_privilege(prv);
+  bool new_v = virt && new_prv != PRV_M;
+
+  // The TLB, and the icache behind it, only hold translations made at the
+  // current privilege, so a trap or return that keeps it can keep them.
+  // Debug mode and MPRV can change the effective privilege regardless.
+  if (new_prv != state.prv || new_v != state.v || state.debug_mode ||
+      get_field(state.mstatus->read(), MSTATUS_MPRV))
+    mmu->flush_tlb();
+
   state.prev_prv = state.prv;
   state.prev_v = state.v;
-  state.prv = legalize_privilege(prv);
-  state.v = virt && state.prv != PRV_M;
+  state.prv = new_prv;
+  state.v = new_v;
   state.prv_changed = state.prv != state.prev_prv;
   state.v_changed = state.v != state.prev_v;
 }
@@ -569,6 +719,11 @@ const char* processor_t::get_symbol(uint64_t addr)
   return sim->get_symbol(addr);
 }
 
+const char* processor_t::get_symbol(uint64_t addr, uint64_t* offset)
+{
+  return sim->get_symbol(addr, offset);
+}
+
 void processor_t::check_if_lpad_required()
 {
   if (unlikely(state.elp == elp_t::LP_EXPECTED)) {
@@ -669,17 +824,7 @@ insn_func_t processor_t::decode_insn(insn_t insn)
   bool rve = extension_enabled('E');
 
   if (unlikely(!hit)) {
-    // fall back to linear search
-    auto matching = [insn_bits = insn.bits()](const insn_desc_t &d) {
-      return (insn_bits & d.mask) == d.match;
-    };
-    auto p = std::find_if(custom_instructions.begin(),
-                          custom_instructions.end(), matching);
-    if (p == custom_instructions.end()) {
-      p = std::find_if(instructions.begin(), instructions.end(), matching);
-      assert(p != instructions.end());
-    }
-    desc = &*p;
+    desc = decode_tree.lookup(insn.bits());
     opcode_cache[idx].replace(insn.bits(), desc);
   }
 
@@ -700,6 +845,14 @@ void processor_t::build_opcode_map()
 {
   for (size_t i = 0; i < OPCODE_CACHE_SIZE; i++)
     opcode_cache[i].reset();
+
+  // custom instructions take precedence over the base ones
+  std::vector<const insn_desc_t*> descs;
+  for (auto &d : custom_instructions)
+    descs.push_back(&d);
+  for (auto &d : instructions)
+    descs.push_back(&d);
+  decode_tree.build(descs);
 }
 
 void processor_t::register_extension(extension_t *x) {
@@ -758,8 +911,7 @@ void processor_t::register_base_instructions()
   #undef DECLARE_OVERLAP_INSN
 
   // add all other instructions.  since they are non-overlapping, the order
-  // does not affect correctness, but more frequent instructions should
-  // appear earlier to improve search time on opcode_cache misses.
+  // does not affect correctness.
   #define DEFINE_INSN(name) \
     if (!name##_overlapping) \
       register_base_insn((insn_desc_t) { \
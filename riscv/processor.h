@@ -17,12 +17,16 @@
 #include "triggers.h"
 #include "../fesvr/memif.h"
 #include "vector_unit.h"
+#include "decode_tree.h"
 
 #define FIRST_HPMCOUNTER 3
 #define N_HPMCOUNTERS 29
 
 class processor_t;
 class mmu_t;
+class dbt_t;
+class profiler_t;
+class bbv_t;
 typedef reg_t (*insn_func_t)(processor_t*, insn_t, reg_t);
 class simif_t;
 class trap_t;
@@ -72,6 +76,7 @@ struct state_t
 {
   void reset(processor_t* const proc, reg_t max_isa);
   void add_csr(reg_t addr, const csr_t_p& csr);
+  void checkpoint(checkpoint_t& c);
 
   reg_t pc;
   regfile_t<reg_t, NXPR, true> XPR;
@@ -253,6 +258,14 @@ public:
 
   void set_debug(bool value);
   void set_histogram(bool value);
+  void set_dbt(bool value);
+  // Sample the PC every `period` retired instructions; 0 disables.
+  void set_profile(size_t period);
+  // Write basic-block vectors to `path` every `interval` retired
+  // instructions; 0 disables.
+  void set_bbv(const std::string& path, size_t interval);
+  // Save or restore the hart's state; see checkpoint.h
+  void checkpoint(checkpoint_t& c);
   void enable_log_commits();
   bool get_log_commits_enabled() const { return log_commits_enabled; }
   void reset();
@@ -362,9 +375,12 @@ public:
   void set_mmu_capability(int cap);
 
   const char* get_symbol(uint64_t addr);
+  const char* get_symbol(uint64_t addr, uint64_t* offset);
 
   void clear_waiting_for_interrupt() { in_wfi = false; };
   bool is_waiting_for_interrupt() { return in_wfi; };
+  // Account for n calls to step() that each find the hart still waiting.
+  void skip_wfi_steps(reg_t n);
 
   void check_if_lpad_required();
 
@@ -374,12 +390,18 @@ private:
 
   simif_t* sim;
   mmu_t* mmu; // main memory is always accessed via the mmu
+  dbt_t* dbt; // translator for hot blocks, if enabled
+  profiler_t* profiler; // PC sampler, if enabled
+  size_t profile_left; // instructions until the next sample
+  bbv_t* bbv; // basic-block vector collector, if enabled
+  size_t bbv_left; // instructions until the end of its interval
   std::unordered_map<std::string, extension_t*> custom_extensions;
   disassembler_t* disassembler;
   state_t state;
   uint32_t id;
   unsigned xlen;
   bool histogram_enabled;
+  bool count_blocks; // the fast path counts visits to icache blocks
   bool log_commits_enabled;
   FILE *log_file;
   std::ostream sout_; // needed for socket command interface -s, also used for -d and -l, but not for --log
@@ -399,6 +421,10 @@ private:
 
   static const size_t OPCODE_CACHE_SIZE = 4095;
   opcode_cache_entry_t opcode_cache[OPCODE_CACHE_SIZE];
+  decode_tree_t decode_tree; // backs opcode_cache
+
+  void profile_retired(reg_t n);
+  void bbv_retired(reg_t n);
 
   void take_pending_interrupt() { take_interrupt(state.mip->read() & state.mie->read()); }
   void take_interrupt(reg_t mask); // take first enabled interrupt in mask
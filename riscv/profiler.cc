@@ -0,0 +1,104 @@
+// See LICENSE for license details.
+
+#include "config.h"
+#include "profiler.h"
+#include "processor.h"
+#include "mmu.h"
+#include "simif.h"
+#include <algorithm>
+#include <cinttypes>
+#include <set>
+
+profiler_t::profiler_t(processor_t* proc, simif_t* sim, size_t period)
+  : period(period), proc(proc), sim(sim)
+{
+}
+
+void profiler_t::sample(reg_t weight)
+{
+  state_t* state = proc->get_state();
+  std::vector<std::string> stack{function_name(state->pc)};
+
+  if (state->prv == PRV_M && !get_field(state->mstatus->read(), MSTATUS_MPRV)) {
+    // a frame holds the return address, then the caller's frame pointer,
+    // just below its own frame pointer; the stack grows down
+    const reg_t word = proc->get_xlen() / 8;
+    reg_t fp = state->XPR[8], ra, caller_fp;
+    while (stack.size() < MAX_DEPTH && fp % word == 0 &&
+           read_stack(fp - word, ra) && read_stack(fp - 2 * word, caller_fp) && ra != 0) {
+      // the call itself, which a noreturn call leaves at the very end of
+      // its function
+      stack.push_back(function_name(ra - 1));
+      if (caller_fp <= fp)
+        break;
+      fp = caller_fp;
+    }
+  }
+
+  std::reverse(stack.begin(), stack.end());
+  stacks[stack] += weight;
+}
+
+void profiler_t::report(FILE* out)
+{
+  struct counts_t {
+    uint64_t self = 0;
+    uint64_t total = 0;
+  };
+  std::map<std::string, counts_t> functions;
+  uint64_t samples = 0;
+  for (auto& [stack, count] : stacks) {
+    samples += count;
+    functions[stack.back()].self += count;
+    // a recursive function counts once per sample
+    for (auto& f : std::set<std::string>(stack.begin(), stack.end()))
+      functions[f].total += count;
+  }
+
+  std::vector<std::pair<std::string, counts_t>> flat(functions.begin(), functions.end());
+  std::sort(flat.begin(), flat.end(),
+            [](auto& lhs, auto& rhs) { return lhs.second.self > rhs.second.self; });
+
+  // the flat profile's lines never end in a number, which flamegraph.pl
+  // skips, so the whole report can be fed to it
+  fprintf(out, "Profile of core %" PRIu32 ": %" PRIu64 " samples, one per %zu instructions\n",
+          proc->get_id(), samples, period);
+  fprintf(out, "%8s %8s  function\n", "self", "total");
+  for (auto& [name, counts] : flat)
+    fprintf(out, "%7.2f%% %7.2f%%  %s\n",
+            100.0 * counts.self / samples, 100.0 * counts.total / samples, name.c_str());
+
+  for (auto& [stack, count] : stacks) {
+    const char* sep = "";
+    for (auto& f : stack) {
+      fprintf(out, "%s%s", sep, f.c_str());
+      sep = ";";
+    }
+    fprintf(out, " %" PRIu64 "\n", count);
+  }
+}
+
+bool profiler_t::read_stack(reg_t addr, reg_t& value)
+{
+  char* host = sim->addr_to_mem(addr);
+  if (!host)
+    return false;
+
+  mmu_t* mmu = proc->get_mmu();
+  if (proc->get_xlen() == 32)
+    value = mmu->from_target(*(target_endian<uint32_t>*)host);
+  else
+    value = mmu->from_target(*(target_endian<uint64_t>*)host);
+  return true;
+}
+
+std::string profiler_t::function_name(reg_t pc)
+{
+  uint64_t offset;
+  if (const char* sym = proc->get_symbol(pc, &offset))
+    return sym;
+
+  char name[2 + 16 + 1];
+  snprintf(name, sizeof(name), "0x%" PRIx64, pc);
+  return name;
+}
@@ -0,0 +1,46 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PROFILER_H
+#define _RISCV_PROFILER_H
+
+#include "decode.h"
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+class processor_t;
+class simif_t;
+
+// Samples a hart's call stack every `period` retired instructions, and at
+// exit reports a flat profile by function followed by the sampled stacks,
+// folded one per line in the form flamegraph.pl reads.
+//
+// Callers are found by following the frame-pointer chain, which takes code
+// built with -fno-omit-frame-pointer.  The chain is only followed in M-mode
+// with MPRV clear, where stack addresses are physical, and only through
+// RAM, so sampling never disturbs the simulation; elsewhere a sample holds
+// just the PC.
+class profiler_t
+{
+public:
+  profiler_t(processor_t* proc, simif_t* sim, size_t period);
+
+  const size_t period;
+
+  // count the hart's current stack `weight` times
+  void sample(reg_t weight);
+  void report(FILE* out);
+
+private:
+  static const size_t MAX_DEPTH = 64;
+
+  processor_t* proc;
+  simif_t* sim;
+  std::map<std::vector<std::string>, uint64_t> stacks; // outermost first
+
+  bool read_stack(reg_t addr, reg_t& value);
+  std::string function_name(reg_t pc);
+};
+
+#endif
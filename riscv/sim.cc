@@ -9,14 +9,18 @@
 #include "platform.h"
 #include "libfdt.h"
 #include "socketif.h"
+#include "checkpoint.h"
 #include <fstream>
 #include <map>
 #include <iostream>
 #include <sstream>
 #include <climits>
+#include <cstring>
 #include <cstdlib>
 #include <cassert>
+#include <utility>
 #include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
@@ -45,7 +49,8 @@ sim_t::sim_t(const cfg_t *cfg, bool halted,
              bool dtb_enabled, const char *dtb_file,
              bool socket_enabled,
              FILE *cmd_file, // needed for command line option --cmd
-             std::optional<unsigned long long> instruction_limit)
+             std::optional<unsigned long long> instruction_limit,
+             const char *checkpoint_file)
   : htif_t(args),
     cfg(cfg),
     mems(mems),
@@ -56,6 +61,12 @@ sim_t::sim_t(const cfg_t *cfg, bool halted,
     sout_(nullptr),
     current_step(0),
     current_proc(0),
+    parallel_quantum(0),
+    parallel_budget(0),
+    quantum_generation(0),
+    harts_running(0),
+    hart_threads_exit(false),
+    skip_idle(false),
     debug(false),
     histogram_enabled(false),
     log(false),
@@ -98,6 +109,17 @@ sim_t::sim_t(const cfg_t *cfg, bool halted,
 
   debug_mmu = new mmu_t(this, cfg->endianness, NULL);
 
+  // A restored machine keeps the device tree it was saved with; the rest
+  // of its state waits for reset()
+  if (checkpoint_file) {
+    restoring.reset(new checkpoint_t(checkpoint_file, checkpoint_t::RESTORE));
+    restoring->section("device tree");
+    restoring->io(dtb);
+    if (dtb.empty() == dtb_enabled)
+      throw std::runtime_error(std::string("checkpoint ") + checkpoint_file + " was saved " +
+                               (dtb_enabled ? "with" : "without") + " --disable-dtb");
+  }
+
   // When running without using a dtb, skip the fdt-based configuration steps
   if (!dtb_enabled) {
     for (size_t i = 0; i < cfg->nprocs(); i++) {
@@ -126,7 +148,9 @@ sim_t::sim_t(const cfg_t *cfg, bool halted,
                           plugin_device_factories.end());
 
   // Load dtb_file if provided, otherwise self-generate a dts/dtb
-  if (dtb_file) {
+  if (restoring) {
+    dts = dtb_to_dts(dtb);
+  } else if (dtb_file) {
     std::ifstream fin(dtb_file, std::ios::binary);
     if (!fin.good()) {
       std::cerr << "can't find dtb file: " << dtb_file << std::endl;
@@ -262,6 +286,7 @@ sim_t::sim_t(const cfg_t *cfg, bool halted,
 
 sim_t::~sim_t()
 {
+  stop_hart_threads();
   for (size_t i = 0; i < procs.size(); i++)
     delete procs[i];
   delete debug_mmu;
@@ -276,13 +301,18 @@ int sim_t::run()
 
   // htif_t::run() will repeatedly call back into sim_t::idle(), each
   // invocation of which will advance target time
-  return htif_t::run();
+  int ret = htif_t::run();
+  wait_for_forks();
+  return ret;
 }
 
 void sim_t::step(size_t n)
 {
   for (size_t i = 0, steps = 0; i < n; i += steps)
   {
+    if (unlikely(skip_idle) && current_step == 0 && current_proc == 0)
+      skip_idle_time(INTERLEAVE / INSNS_PER_RTC_TICK);
+
     steps = std::min(n - i, INTERLEAVE - current_step);
     procs[current_proc]->step(steps);
 
@@ -300,6 +330,296 @@ void sim_t::step(size_t n)
   }
 }
 
+void sim_t::step_parallel(size_t n)
+{
+  if (hart_threads.empty()) {
+    for (size_t i = 1; i < procs.size(); i++)
+      hart_threads.emplace_back(&sim_t::hart_thread_main, this, i);
+  }
+
+  // n counts instructions across all harts, as for step(); each round
+  // retires a quantum on every hart
+  const size_t round = parallel_quantum * procs.size();
+  for (parallel_budget += n; parallel_budget >= round; parallel_budget -= round) {
+    if (unlikely(skip_idle))
+      skip_idle_time(parallel_quantum / INSNS_PER_RTC_TICK);
+
+    {
+      std::lock_guard<std::mutex> lock(quantum_mutex);
+      harts_running = procs.size() - 1;
+      quantum_generation++;
+    }
+    quantum_start.notify_all();
+
+    procs[0]->step(parallel_quantum);
+
+    std::unique_lock<std::mutex> lock(quantum_mutex);
+    quantum_done.wait(lock, [&] { return harts_running == 0; });
+    if (hart_thread_exception)
+      std::rethrow_exception(std::exchange(hart_thread_exception, nullptr));
+    lock.unlock();
+
+    reg_t rtc_ticks = parallel_quantum / INSNS_PER_RTC_TICK;
+    for (auto &dev : devices) dev->tick(rtc_ticks);
+  }
+}
+
+void sim_t::hart_thread_main(size_t i)
+{
+  uint64_t generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(quantum_mutex);
+      quantum_start.wait(lock, [&] { return hart_threads_exit || quantum_generation != generation; });
+      if (hart_threads_exit)
+        return;
+      generation = quantum_generation;
+    }
+
+    std::exception_ptr exception;
+    try {
+      procs[i]->step(parallel_quantum);
+    } catch (...) {
+      exception = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(quantum_mutex);
+    if (exception && !hart_thread_exception)
+      hart_thread_exception = exception;
+    if (--harts_running == 0)
+      quantum_done.notify_one();
+  }
+}
+
+void sim_t::stop_hart_threads()
+{
+  {
+    std::lock_guard<std::mutex> lock(quantum_mutex);
+    hart_threads_exit = true;
+  }
+  quantum_start.notify_all();
+  for (auto &t : hart_threads)
+    t.join();
+  hart_threads.clear();
+}
+
+// Called at the start of a round, in which the harts take a step each and
+// then the devices tick.  A hart waiting for an interrupt that has none
+// pending retires nothing but the wait, so if every hart is waiting and
+// only a timer can wake one, the rounds before the earliest enabled timer
+// fires are all alike: run them in one go.
+void sim_t::skip_idle_time(reg_t ticks_per_round)
+{
+  if (!clint || cfg->real_time_clint)
+    return;
+
+  reg_t now = clint->get_mtime();
+  reg_t deadline = UINT64_MAX;
+  for (auto& [hartid, proc] : harts) {
+    auto state = proc->get_state();
+    reg_t mie = state->mie->read();
+    if (!proc->is_waiting_for_interrupt() || proc->halt_request != proc->HR_NONE ||
+        (state->mip->read() & mie))
+      return;
+
+    if (mie & MIP_MTIP)
+      deadline = std::min(deadline, clint->get_mtimecmp(hartid));
+    if (proc->extension_enabled(EXT_SSTC)) {
+      if ((mie & MIP_STIP) && (state->menvcfg->read() & MENVCFG_STCE))
+        deadline = std::min(deadline, state->stimecmp->read());
+      if ((mie & MIP_VSTIP) && (state->henvcfg->read() & HENVCFG_STCE)) {
+        reg_t vstimecmp = state->vstimecmp->read(), htimedelta = state->htimedelta->read();
+        deadline = std::min(deadline, vstimecmp >= htimedelta ? vstimecmp - htimedelta : 0);
+      }
+    }
+  }
+
+  // the timer fires in the round that takes mtime to the deadline; skip
+  // the ones before it
+  if (deadline <= now || deadline == UINT64_MAX)
+    return;
+  reg_t rounds = (deadline - now - 1) / ticks_per_round;
+  if (rounds == 0)
+    return;
+
+  for (auto &dev : devices) dev->tick(rounds * ticks_per_round);
+  for (auto proc : procs) {
+    proc->get_mmu()->yield_load_reservation();
+    proc->skip_wfi_steps(rounds);
+  }
+}
+
+// Everything but the device tree, which the constructor needs first
+void sim_t::checkpoint(checkpoint_t& c)
+{
+  c.section("machine");
+  reg_t entry = get_entry_point();
+  addr_t tohost = get_tohost_addr(), fromhost = get_fromhost_addr();
+  c.io(entry);
+  c.io(tohost);
+  c.io(fromhost);
+  if (!c.saving())
+    set_program_addresses(entry, tohost, fromhost);
+  c.io(current_step);
+  c.io(current_proc);
+
+  c.expect(mems.size(), "memory regions");
+  for (auto& [base, mem] : mems) {
+    c.expect(base, "memory regions");
+    mem->checkpoint(c);
+  }
+  // the boot ROM, which has no state, is last, and is only added after
+  // a restore
+  for (auto &dev : devices)
+    dev->checkpoint(c);
+  debug_module.checkpoint(c);
+  c.expect(procs.size(), "hart count");
+  for (auto proc : procs)
+    proc->checkpoint(c);
+}
+
+void sim_t::save_checkpoint_at(const char* path, unsigned long long instructions,
+                               unsigned long long period)
+{
+  checkpoint_path = path;
+  checkpoint_countdown = instructions;
+  checkpoint_period = period;
+}
+
+void sim_t::fork_at(const char* path, unsigned long long instructions,
+                    const std::vector<std::string>& variants)
+{
+  fork_path = path;
+  fork_countdown = instructions;
+  fork_variants = variants;
+}
+
+void sim_t::set_fork_handler(std::function<void(const std::string&)> handler)
+{
+  fork_handler = handler;
+}
+
+void sim_t::set_instruction_limit(unsigned long long instructions)
+{
+  instruction_limit = instructions;
+}
+
+// Fork a copy of the simulator that carries on from the current state,
+// sharing guest memory with this one copy-on-write.  Returns true in the
+// child, which has made the variant's changes, sends its output to
+// `output`, and leaves anything else due later, such as other forks and
+// checkpoints, to the parent.
+bool sim_t::fork_child(const std::string& output, const std::string& variant)
+{
+  // only the calling thread would survive into the child
+  if (!hart_threads.empty())
+    throw std::runtime_error("cannot fork with --parallel");
+
+  int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    throw std::runtime_error("could not open " + output + ": " + strerror(errno));
+
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0)
+    throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+  if (pid > 0) {
+    close(fd);
+    forks.emplace_back(pid, output);
+    return false;
+  }
+
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  close(fd);
+  // the terminal is the parent's; a variant may give the child its own input
+  int null_fd = open("/dev/null", O_RDONLY);
+  dup2(null_fd, STDIN_FILENO);
+  close(null_fd);
+  signal(SIGINT, SIG_IGN);
+
+  forks.clear();
+  fork_countdown.reset();
+  checkpoint_countdown.reset();
+  debug = false;
+  set_procs_debug(log);
+
+  if (fork_handler)
+    fork_handler(variant);
+  return true;
+}
+
+void sim_t::wait_for_forks()
+{
+  for (auto& [pid, output] : forks) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid)
+      continue;
+    if (WIFSIGNALED(status))
+      fprintf(stderr, "fork writing to %s was killed by signal %d\n", output.c_str(), WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+      fprintf(stderr, "fork writing to %s exited with status %d\n", output.c_str(), WEXITSTATUS(status));
+  }
+  forks.clear();
+}
+
+void sim_t::save_checkpoint()
+{
+  std::string path = checkpoint_path;
+  if (checkpoints_saved)
+    path += "." + std::to_string(checkpoints_saved);
+
+  checkpoint_t c(path, checkpoint_t::SAVE);
+  c.section("device tree");
+  c.io(dtb);
+  c.section("previous checkpoint");
+  c.io(last_checkpoint);
+  c.incremental = !last_checkpoint.empty();
+  checkpoint(c);
+
+  // saving cleared the dirty pages, so drop the store translations that
+  // would let their next writes go unnoticed
+  for (auto proc : procs)
+    proc->get_mmu()->flush_store_tlb();
+  debug_mmu->flush_store_tlb();
+
+  last_checkpoint = path;
+  checkpoints_saved++;
+}
+
+// Read the rest of a checkpoint's header, which the device tree begins,
+// returning the checkpoint it holds the changes since, if any
+static std::string read_previous_checkpoint(checkpoint_t& c)
+{
+  std::string previous;
+  c.section("previous checkpoint");
+  c.io(previous);
+  c.incremental = !previous.empty();
+  return previous;
+}
+
+void sim_t::restore_checkpoint(checkpoint_t& c)
+{
+  // an incremental checkpoint only holds the memory written since the one
+  // before it, so restore the chain from the last full checkpoint on
+  std::vector<std::string> chain;
+  for (auto path = read_previous_checkpoint(c); !path.empty(); ) {
+    chain.push_back(path);
+    checkpoint_t p(path, checkpoint_t::RESTORE);
+    p.section("device tree");
+    p.expect(dtb, "device tree");
+    path = read_previous_checkpoint(p);
+  }
+  for (auto path = chain.rbegin(); path != chain.rend(); ++path) {
+    checkpoint_t p(*path, checkpoint_t::RESTORE);
+    p.section("device tree");
+    p.expect(dtb, "device tree");
+    read_previous_checkpoint(p);
+    checkpoint(p);
+  }
+  checkpoint(c);
+}
+
 void sim_t::add_device(reg_t addr, std::shared_ptr<abstract_device_t> dev) {
   bus.add_device(addr, dev.get());
   devices.push_back(dev);
@@ -318,6 +638,44 @@ void sim_t::set_histogram(bool value)
   }
 }
 
+void sim_t::set_dbt(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_dbt(value);
+  }
+}
+
+void sim_t::set_profile(size_t period)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_profile(period);
+  }
+}
+
+void sim_t::set_bbv(const char* path, size_t interval)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_bbv(std::string(path) + "." + std::to_string(procs[i]->get_id()) + ".bb", interval);
+  }
+}
+
+void sim_t::set_parallel(size_t quantum)
+{
+  if (procs.size() < 2)
+    return;
+
+  // keep the devices ticking at whole RTC periods
+  parallel_quantum = std::max(quantum / INSNS_PER_RTC_TICK, size_t(1)) * INSNS_PER_RTC_TICK;
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->get_mmu()->set_host_atomics(true);
+  }
+}
+
+void sim_t::set_skip_idle(bool value)
+{
+  skip_idle = value;
+}
+
 void sim_t::configure_log(bool enable_log, bool enable_commitlog)
 {
   log = enable_log;
@@ -346,6 +704,10 @@ bool sim_t::mmio_load(reg_t paddr, size_t len, uint8_t* bytes)
 {
   if (paddr + len < paddr || !paddr_ok(paddr + len - 1))
     return false;
+  // devices are not thread-safe, so harts running in parallel take turns
+  std::unique_lock<std::mutex> lock(mmio_mutex, std::defer_lock);
+  if (parallel_quantum)
+    lock.lock();
   return bus.load(paddr, len, bytes);
 }
 
@@ -353,6 +715,9 @@ bool sim_t::mmio_store(reg_t paddr, size_t len, const uint8_t* bytes)
 {
   if (paddr + len < paddr || !paddr_ok(paddr + len - 1))
     return false;
+  std::unique_lock<std::mutex> lock(mmio_mutex, std::defer_lock);
+  if (parallel_quantum)
+    lock.lock();
   return bus.store(paddr, len, bytes);
 }
 
@@ -401,13 +766,25 @@ void sim_t::set_rom()
   add_device(DEFAULT_RSTVEC, boot_rom);
 }
 
-char* sim_t::addr_to_mem(reg_t paddr) {
+abstract_mem_t* sim_t::find_mem(reg_t paddr, reg_t* offset) {
   if (!paddr_ok(paddr))
     return NULL;
-  auto desc = bus.find_device(paddr);
-  if (auto mem = dynamic_cast<abstract_mem_t*>(desc.second))
-    if (paddr - desc.first < mem->size())
-      return mem->contents(paddr - desc.first);
+  return bus.find_mem(paddr, offset);
+}
+
+char* sim_t::addr_to_mem(reg_t paddr) {
+  reg_t offset;
+  if (auto mem = find_mem(paddr, &offset))
+    return mem->contents(offset);
+  return NULL;
+}
+
+char* sim_t::addr_to_mem_for_store(reg_t paddr) {
+  reg_t offset;
+  if (auto mem = find_mem(paddr, &offset)) {
+    mem->mark_dirty(offset);
+    return mem->contents(offset);
+  }
   return NULL;
 }
 
@@ -416,14 +793,32 @@ const char* sim_t::get_symbol(uint64_t paddr)
   return htif_t::get_symbol(paddr);
 }
 
+const char* sim_t::get_symbol(uint64_t paddr, uint64_t* offset)
+{
+  return htif_t::get_symbol(paddr, offset);
+}
+
 // htif
 
 void sim_t::reset()
 {
+  if (restoring) {
+    restore_checkpoint(*restoring);
+    restoring.reset();
+    // the harts flushed their own TLBs; memory may have moved under this one
+    debug_mmu->flush_tlb();
+  }
   if (dtb_enabled)
     set_rom();
 }
 
+void sim_t::load_program()
+{
+  // a restored machine's memory already holds its program
+  if (!restoring)
+    htif_t::load_program();
+}
+
 void sim_t::idle()
 {
   if (done())
@@ -432,36 +827,104 @@ void sim_t::idle()
   if (debug || ctrlc_pressed)
     interactive();
   else {
+    // in parallel, each call advances every hart by a quantum; otherwise
+    // it runs to the end of the current slice, which is the whole slice
+    // unless a checkpoint split it
+    size_t n = parallel_quantum ? parallel_quantum * procs.size() : INTERLEAVE - current_step;
+    // stop short where a checkpoint or fork falls
+    if (checkpoint_countdown.has_value() && *checkpoint_countdown < n)
+      n = *checkpoint_countdown;
+    if (fork_countdown.has_value() && *fork_countdown < n)
+      n = *fork_countdown;
     if (instruction_limit.has_value()) {
-      if (*instruction_limit < INTERLEAVE) {
+      if (*instruction_limit < n) {
         // Final step.
         step(*instruction_limit);
         htif_exit(0);
         *instruction_limit = 0;
         return;
       }
-      *instruction_limit -= INTERLEAVE;
+      *instruction_limit -= n;
+    }
+    if (parallel_quantum)
+      step_parallel(n);
+    else
+      step(n);
+
+    if (checkpoint_countdown.has_value() && (*checkpoint_countdown -= n) == 0) {
+      save_checkpoint();
+      if (checkpoint_period)
+        checkpoint_countdown = checkpoint_period;
+      else
+        checkpoint_countdown.reset();
+    }
+
+    if (fork_countdown.has_value() && (*fork_countdown -= n) == 0) {
+      fork_countdown.reset();
+      for (size_t i = 0; i < fork_variants.size(); i++)
+        if (fork_child(fork_path + "." + std::to_string(i + 1), fork_variants[i]))
+          break;
     }
-    step(INTERLEAVE);
   }
 
   if (remote_bitbang)
     remote_bitbang->tick();
 }
 
+// Copy between the target and host buffers a page at a time, straight to
+// or from memory where it is memory, and otherwise a doubleword at a time
+// through the debug MMU.  Stores with no bytes clear.
+void sim_t::access_chunks(addr_t taddr, size_t len, uint8_t* bytes, bool store)
+{
+  assert(taddr % chunk_align() == 0 && len % chunk_align() == 0);
+
+  while (len > 0) {
+    size_t n = std::min<size_t>(len, PGSIZE - taddr % PGSIZE);
+    reg_t offset;
+    if (auto mem = find_mem(taddr, &offset)) {
+      n = std::min<size_t>(n, mem->size() - offset);
+      if (!store) {
+        memcpy(bytes, mem->contents(offset), n);
+      } else {
+        mem->mark_dirty(offset);
+        if (bytes)
+          memcpy(mem->contents(offset), bytes, n);
+        else
+          memset(mem->contents(offset), 0, n);
+      }
+    } else {
+      for (size_t i = 0; i < n; i += 8) {
+        target_endian<uint64_t> data = target_endian<uint64_t>::zero;
+        if (!store) {
+          data = debug_mmu->to_target(debug_mmu->load<uint64_t>(taddr + i));
+          memcpy(bytes + i, &data, sizeof data);
+        } else {
+          if (bytes)
+            memcpy(&data, bytes + i, sizeof data);
+          debug_mmu->store<uint64_t>(taddr + i, debug_mmu->from_target(data));
+        }
+      }
+    }
+    taddr += n;
+    len -= n;
+    if (bytes)
+      bytes += n;
+  }
+}
+
 void sim_t::read_chunk(addr_t taddr, size_t len, void* dst)
 {
-  assert(len == 8);
-  auto data = debug_mmu->to_target(debug_mmu->load<uint64_t>(taddr));
-  memcpy(dst, &data, sizeof data);
+  access_chunks(taddr, len, (uint8_t*)dst, false);
 }
 
 void sim_t::write_chunk(addr_t taddr, size_t len, const void* src)
 {
-  assert(len == 8);
-  target_endian<uint64_t> data;
-  memcpy(&data, src, sizeof data);
-  debug_mmu->store<uint64_t>(taddr, debug_mmu->from_target(data));
+  access_chunks(taddr, len, const_cast<uint8_t*>((const uint8_t*)src), true);
+}
+
+void sim_t::clear_chunk(addr_t taddr, size_t len)
+{
+  access_chunks(taddr, len, nullptr, true);
 }
 
 endianness_t sim_t::get_target_endianness() const
@@ -15,9 +15,14 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <sys/types.h>
 
 class mmu_t;
+class checkpoint_t;
 class remote_bitbang_t;
 class socketif_t;
 
@@ -36,12 +41,40 @@ public:
         bool dtb_enabled, const char *dtb_file,
         bool socket_enabled,
         FILE *cmd_file, // needed for command line option --cmd
-        std::optional<unsigned long long> instruction_limit);
+        std::optional<unsigned long long> instruction_limit,
+        // restore the machine from this instead of loading a program
+        const char *checkpoint_file = nullptr);
   ~sim_t();
 
   int run();
   void set_debug(bool value);
   void set_histogram(bool value);
+  void set_dbt(bool value);
+  void set_profile(size_t period);
+  // Write each hart's basic-block vectors every `interval` instructions
+  // to path.<hartid>.bb; see bbv.h.
+  void set_bbv(const char* path, size_t interval);
+  // Run each hart on its own host thread, synchronising every `quantum`
+  // instructions; has no effect on a single-hart system.
+  void set_parallel(size_t quantum);
+  // Skip ahead in simulated time while every hart waits for a timer.
+  void set_skip_idle(bool value);
+  // Save the machine's state to `path` once `instructions` instructions
+  // have been stepped, counted as for instruction_limit.  If `period` is
+  // nonzero, save again every `period` instructions after that, to
+  // path.1, path.2, ..., each holding only the memory written since the
+  // checkpoint before it.
+  void save_checkpoint_at(const char* path, unsigned long long instructions,
+                          unsigned long long period = 0);
+  // Once `instructions` instructions have been stepped, fork a copy of the
+  // simulator per variant, each carrying on from there with its output
+  // going to path.1, path.2, ...; see fork_child().
+  void fork_at(const char* path, unsigned long long instructions,
+               const std::vector<std::string>& variants);
+  // Makes a fork's changes, in the child; it may exit on a bad variant.
+  void set_fork_handler(std::function<void(const std::string&)> handler);
+  // Stop after `instructions` more instructions.
+  void set_instruction_limit(unsigned long long instructions);
   void add_device(reg_t addr, std::shared_ptr<abstract_device_t> dev);
 
   // Configure logging
@@ -87,6 +120,25 @@ private:
 
   std::optional<unsigned long long> instruction_limit;
 
+  std::unique_ptr<checkpoint_t> restoring; // until reset() gets to it
+  std::string checkpoint_path;
+  std::optional<unsigned long long> checkpoint_countdown;
+  unsigned long long checkpoint_period = 0;
+  unsigned checkpoints_saved = 0;
+  std::string last_checkpoint; // that the next one holds the changes since
+  void checkpoint(checkpoint_t& c);
+  void save_checkpoint();
+  void restore_checkpoint(checkpoint_t& c);
+  abstract_mem_t* find_mem(reg_t paddr, reg_t* offset);
+
+  std::string fork_path;
+  std::optional<unsigned long long> fork_countdown;
+  std::vector<std::string> fork_variants;
+  std::function<void(const std::string&)> fork_handler;
+  std::vector<std::pair<pid_t, std::string>> forks; // and their output
+  bool fork_child(const std::string& output, const std::string& variant);
+  void wait_for_forks();
+
   socketif_t *socketif;
   std::ostream sout_; // used for socket and terminal interface
 
@@ -94,6 +146,27 @@ private:
   void step(size_t n); // step through simulation
   size_t current_step;
   size_t current_proc;
+
+  // parallel execution: hart 0 runs on the simulation thread, every other
+  // hart on a thread of its own, all of them `parallel_quantum`
+  // instructions at a time
+  void step_parallel(size_t n);
+  void hart_thread_main(size_t i);
+  void stop_hart_threads();
+  size_t parallel_quantum; // 0 if harts take turns instead
+  size_t parallel_budget;
+  std::vector<std::thread> hart_threads;
+  std::mutex quantum_mutex;
+  std::condition_variable quantum_start;
+  std::condition_variable quantum_done;
+  uint64_t quantum_generation;
+  size_t harts_running;
+  bool hart_threads_exit;
+  std::exception_ptr hart_thread_exception;
+  std::mutex mmio_mutex;
+
+  bool skip_idle;
+  void skip_idle_time(reg_t ticks_per_round);
   bool debug;
   bool histogram_enabled; // provide a histogram of PCs
   bool log;
@@ -102,11 +175,13 @@ private:
 
   // memory-mapped I/O routines
   virtual char* addr_to_mem(reg_t paddr) override;
+  virtual char* addr_to_mem_for_store(reg_t paddr) override;
   virtual bool mmio_load(reg_t paddr, size_t len, uint8_t* bytes) override;
   virtual bool mmio_store(reg_t paddr, size_t len, const uint8_t* bytes) override;
   void set_rom();
 
   virtual const char* get_symbol(uint64_t paddr) override;
+  virtual const char* get_symbol(uint64_t paddr, uint64_t* offset) override;
 
   // presents a prompt for introspection into the simulation
   void interactive();
@@ -114,6 +189,7 @@ private:
   // functions that help implement interactive()
   void interactive_help(const std::string& cmd, const std::vector<std::string>& args);
   void interactive_quit(const std::string& cmd, const std::vector<std::string>& args);
+  void interactive_fork(const std::string& cmd, const std::vector<std::string>& args);
   void interactive_run(const std::string& cmd, const std::vector<std::string>& args, bool noisy);
   void interactive_run_noisy(const std::string& cmd, const std::vector<std::string>& args);
   void interactive_run_silent(const std::string& cmd, const std::vector<std::string>& args);
@@ -145,11 +221,15 @@ private:
 
   // htif
   virtual void reset() override;
+  virtual void load_program() override;
   virtual void idle() override;
   virtual void read_chunk(addr_t taddr, size_t len, void* dst) override;
   virtual void write_chunk(addr_t taddr, size_t len, const void* src) override;
+  virtual void clear_chunk(addr_t taddr, size_t len) override;
   virtual size_t chunk_align() override { return 8; }
-  virtual size_t chunk_max_size() override { return 8; }
+  // chunks are split by page, so a whole ELF segment can be one chunk
+  virtual size_t chunk_max_size() override { return size_t(1) << 30; }
+  void access_chunks(addr_t taddr, size_t len, uint8_t* bytes, bool store);
   virtual endianness_t get_target_endianness() const override;
 
 public:
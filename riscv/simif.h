@@ -16,6 +16,10 @@ class simif_t
 public:
   // should return NULL for MMIO addresses
   virtual char* addr_to_mem(reg_t paddr) = 0;
+  // as addr_to_mem, for a store: notes the page as written since the last
+  // checkpoint.  Pages are only noted on the slow path, so store TLB
+  // entries must be flushed whenever the notes are cleared.
+  virtual char* addr_to_mem_for_store(reg_t paddr) { return addr_to_mem(paddr); }
   virtual bool reservable(reg_t paddr) { return addr_to_mem(paddr); }
   // used for MMIO addresses
   virtual bool mmio_fetch(reg_t paddr, size_t len, uint8_t* bytes) { return mmio_load(paddr, len, bytes); }
@@ -28,6 +32,7 @@ public:
   virtual const std::map<size_t, processor_t*>& get_harts() const = 0;
 
   virtual const char* get_symbol(uint64_t paddr) = 0;
+  virtual const char* get_symbol(uint64_t paddr, uint64_t* offset) = 0;
 
   virtual ~simif_t() = default;
 
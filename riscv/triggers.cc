@@ -2,6 +2,7 @@
 #include "debug_defines.h"
 #include "processor.h"
 #include "triggers.h"
+#include "checkpoint.h"
 
 #define ASIDMAX(SXLEN) (SXLEN == 32 ? 9 : 16)
 #define SATP_ASID(SXLEN) (SXLEN == 32 ? SATP32_ASID : SATP64_ASID)
@@ -55,6 +56,21 @@ void trigger_t::tdata3_write(processor_t * const proc, const reg_t val) noexcept
   sselect = (sselect_t)((proc->extension_enabled_const('S') && get_field(val, CSR_TEXTRA_SSELECT(xlen)) <= SSELECT_MAXVAL) ? get_field(val, CSR_TEXTRA_SSELECT(xlen)) : SSELECT_IGNORE);
 }
 
+void trigger_t::checkpoint(checkpoint_t& c)
+{
+  c.io(tdata2);
+  c.io(vs);
+  c.io(vu);
+  c.io(m);
+  c.io(s);
+  c.io(u);
+  c.io(sselect);
+  c.io(svalue);
+  c.io(sbytemask);
+  c.io(mhselect);
+  c.io(mhvalue);
+}
+
 static reg_t tcontrol_value(const state_t * state) {
   if (state->tcontrol)
     return state->tcontrol->read();
@@ -152,6 +168,12 @@ bool trigger_t::textra_match(processor_t * const proc) const noexcept
   return true;
 }
 
+void disabled_trigger_t::checkpoint(checkpoint_t& c)
+{
+  trigger_t::checkpoint(c);
+  c.io(dmode);
+}
+
 reg_t disabled_trigger_t::tdata1_read(const processor_t * const proc) const noexcept
 {
   auto xlen = proc->get_xlen();
@@ -168,6 +190,26 @@ void disabled_trigger_t::tdata1_write(processor_t * const proc, const reg_t val,
   dmode = get_field(val, CSR_TDATA1_DMODE(xlen));
 }
 
+void mcontrol_common_t::checkpoint(checkpoint_t& c)
+{
+  trigger_t::checkpoint(c);
+  c.io(dmode);
+  c.io(action);
+  c.io(select);
+  c.io(timing);
+  c.io(chain);
+  c.io(match);
+  c.io(execute);
+  c.io(store);
+  c.io(load);
+}
+
+void mcontrol_t::checkpoint(checkpoint_t& c)
+{
+  mcontrol_common_t::checkpoint(c);
+  c.io(hit);
+}
+
 reg_t mcontrol_t::tdata1_read(const processor_t * const proc) const noexcept {
   reg_t v = 0;
   auto xlen = proc->get_xlen();
@@ -302,6 +344,12 @@ bool mcontrol_common_t::legalize_timing(reg_t val, reg_t timing_mask, reg_t sele
   }
 }
 
+void mcontrol6_t::checkpoint(checkpoint_t& c)
+{
+  mcontrol_common_t::checkpoint(c);
+  c.io(hit);
+}
+
 reg_t mcontrol6_t::tdata1_read(const processor_t * const proc) const noexcept {
   unsigned xlen = proc->get_const_xlen();
   reg_t tdata1 = 0;
@@ -376,6 +424,18 @@ void icount_t::detect_icount_decrement(processor_t * const proc) noexcept
   }
 }
 
+void icount_t::checkpoint(checkpoint_t& c)
+{
+  trigger_t::checkpoint(c);
+  c.io(dmode);
+  c.io(hit);
+  c.io(count);
+  c.io(count_read_value);
+  c.io(pending);
+  c.io(pending_read_value);
+  c.io(action);
+}
+
 reg_t icount_t::tdata1_read(const processor_t * const proc) const noexcept
 {
   auto xlen = proc->get_xlen();
@@ -416,6 +476,20 @@ void icount_t::stash_read_values()
   pending_read_value = pending;
 }
 
+void trap_common_t::checkpoint(checkpoint_t& c)
+{
+  trigger_t::checkpoint(c);
+  c.io(dmode);
+  c.io(hit);
+  c.io(action);
+}
+
+void itrigger_t::checkpoint(checkpoint_t& c)
+{
+  trap_common_t::checkpoint(c);
+  c.io(nmi);
+}
+
 reg_t itrigger_t::tdata1_read(const processor_t * const proc) const noexcept
 {
   auto xlen = proc->get_xlen();
@@ -505,6 +579,18 @@ bool etrigger_t::simple_match(bool interrupt, reg_t bit) const
   return !interrupt && ((tdata2 >> bit) & 1);
 }
 
+static trigger_t* new_trigger(unsigned type)
+{
+  switch (type) {
+    case CSR_TDATA1_TYPE_MCONTROL: return new mcontrol_t();
+    case CSR_TDATA1_TYPE_ICOUNT: return new icount_t();
+    case CSR_TDATA1_TYPE_ITRIGGER: return new itrigger_t();
+    case CSR_TDATA1_TYPE_ETRIGGER: return new etrigger_t();
+    case CSR_TDATA1_TYPE_MCONTROL6: return new mcontrol6_t();
+    default: return new disabled_trigger_t();
+  }
+}
+
 module_t::module_t(unsigned count) : triggers(count) {
   for (unsigned i = 0; i < count; i++) {
     triggers[i] = new disabled_trigger_t();
@@ -551,14 +637,7 @@ bool module_t::tdata1_write(unsigned index, const reg_t val) noexcept
   reg_t tdata2 = triggers[index]->tdata2_read(proc);
   reg_t tdata3 = triggers[index]->tdata3_read(proc);
   delete triggers[index];
-  switch (type) {
-    case CSR_TDATA1_TYPE_MCONTROL: triggers[index] = new mcontrol_t(); break;
-    case CSR_TDATA1_TYPE_ICOUNT: triggers[index] = new icount_t(); break;
-    case CSR_TDATA1_TYPE_ITRIGGER: triggers[index] = new itrigger_t(); break;
-    case CSR_TDATA1_TYPE_ETRIGGER: triggers[index] = new etrigger_t(); break;
-    case CSR_TDATA1_TYPE_MCONTROL6: triggers[index] = new mcontrol6_t(); break;
-    default: triggers[index] = new disabled_trigger_t(); break;
-  }
+  triggers[index] = new_trigger(type);
 
   triggers[index]->tdata1_write(proc, tdata1, allow_chain);
   triggers[index]->tdata2_write(proc, tdata2);
@@ -675,4 +754,20 @@ reg_t module_t::tinfo_read(unsigned UNUSED index) const noexcept
          (CSR_TINFO_VERSION_1 << CSR_TINFO_VERSION_OFFSET);
 }
 
+void module_t::checkpoint(checkpoint_t& c)
+{
+  c.expect(triggers.size(), "trigger count");
+  for (auto& trigger : triggers) {
+    unsigned type = get_field(trigger->tdata1_read(proc), CSR_TDATA1_TYPE(proc->get_xlen()));
+    c.io(type);
+    if (!c.saving()) {
+      delete trigger;
+      trigger = new_trigger(type);
+    }
+    trigger->checkpoint(c);
+  }
+  if (!c.saving())
+    proc->trigger_updated(triggers);
+}
+
 };
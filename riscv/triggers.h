@@ -6,6 +6,8 @@
 
 #include "decode.h"
 
+class checkpoint_t;
+
 namespace triggers {
 
 typedef enum {
@@ -81,6 +83,10 @@ public:
   reg_t tdata3_read(const processor_t * const proc) const noexcept;
   void tdata3_write(processor_t * const proc, const reg_t val) noexcept;
 
+  // Save or restore the trigger's fields; module_t::checkpoint() takes
+  // care of recreating a trigger of the right type
+  virtual void checkpoint(checkpoint_t& c);
+
   virtual bool get_dmode() const = 0;
   virtual bool get_chain() const { return false; }
   virtual bool get_execute() const { return false; }
@@ -151,6 +157,7 @@ class disabled_trigger_t : public trigger_t {
 public:
   virtual reg_t tdata1_read(const processor_t * const proc) const noexcept override;
   virtual void tdata1_write(processor_t * const proc, const reg_t val, const bool allow_chain) noexcept override;
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual bool get_dmode() const override { return dmode; }
 
@@ -160,6 +167,7 @@ private:
 
 class trap_common_t : public trigger_t {
 public:
+  virtual void checkpoint(checkpoint_t& c) override;
   bool get_dmode() const override { return dmode; }
   virtual action_t get_action() const override { return action; }
 
@@ -178,6 +186,7 @@ class itrigger_t : public trap_common_t {
 public:
   virtual reg_t tdata1_read(const processor_t * const proc) const noexcept override;
   virtual void tdata1_write(processor_t * const proc, const reg_t val, const bool allow_chain) noexcept override;
+  virtual void checkpoint(checkpoint_t& c) override;
 
 private:
   virtual bool simple_match(bool interrupt, reg_t bit) const override;
@@ -205,6 +214,7 @@ public:
     MATCH_MASK_HIGH = MCONTROL_MATCH_MASK_HIGH
   } match_t;
 
+  virtual void checkpoint(checkpoint_t& c) override;
   virtual bool get_dmode() const override { return dmode; }
   virtual bool get_chain() const override { return chain; }
   virtual bool get_execute() const override { return execute; }
@@ -237,6 +247,7 @@ class mcontrol_t : public mcontrol_common_t {
 public:
   virtual reg_t tdata1_read(const processor_t * const proc) const noexcept override;
   virtual void tdata1_write(processor_t * const proc, const reg_t val, const bool allow_chain) noexcept override;
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual void set_hit(hit_t val) override { hit = val != HIT_FALSE; }
 
@@ -249,6 +260,7 @@ class mcontrol6_t : public mcontrol_common_t {
 public:
   virtual reg_t tdata1_read(const processor_t * const proc) const noexcept override;
   virtual void tdata1_write(processor_t * const proc, const reg_t val, const bool allow_chain) noexcept override;
+  virtual void checkpoint(checkpoint_t& c) override;
 
   virtual void set_hit(hit_t val) override { hit = val; }
 
@@ -260,6 +272,7 @@ class icount_t : public trigger_t {
 public:
   virtual reg_t tdata1_read(const processor_t * const proc) const noexcept override;
   virtual void tdata1_write(processor_t * const proc, const reg_t val, const bool allow_chain) noexcept override;
+  virtual void checkpoint(checkpoint_t& c) override;
 
   bool get_dmode() const override { return dmode; }
   virtual action_t get_action() const override { return action; }
@@ -290,6 +303,8 @@ public:
   bool tdata3_write(unsigned index, const reg_t val) noexcept;
   reg_t tinfo_read(unsigned index) const noexcept;
 
+  void checkpoint(checkpoint_t& c);
+
   unsigned count() const { return triggers.size(); }
 
   std::optional<match_result_t> detect_memory_access_match(operation_t operation, reg_t address, std::optional<reg_t> data) noexcept;
@@ -0,0 +1,236 @@
+// See LICENSE for license details.
+
+#include "config.h"
+#include "uop.h"
+#include "mmu.h"
+#include "processor.h"
+
+#define UOP_INSNS(X) \
+  X(addi) X(slti) X(sltiu) X(xori) X(ori) X(andi) X(slli) X(srli) X(srai) \
+  X(addiw) X(slliw) X(srliw) X(sraiw) \
+  X(add) X(sub) X(sll) X(slt) X(sltu) X(xor) X(srl) X(sra) X(or) X(and) \
+  X(addw) X(subw) X(sllw) X(srlw) X(sraw) X(mul) X(mulw) \
+  X(lui) X(auipc) \
+  X(lb) X(lh) X(lw) X(ld) X(lbu) X(lhu) X(lwu) X(sb) X(sh) X(sw) X(sd) \
+  X(beq) X(bne) X(blt) X(bge) X(bltu) X(bgeu) \
+  X(c_addi) X(c_jal) X(c_li) X(c_lui) X(c_mv) X(c_add) X(c_sub) X(c_xor) \
+  X(c_or) X(c_and) X(c_andi) X(c_slli) X(c_srli) X(c_srai) X(c_addw) \
+  X(c_subw) X(c_addi4spn) X(c_ld) X(c_lw) X(c_sd) X(c_sw) X(c_ldsp) \
+  X(c_lwsp) X(c_sdsp) X(c_swsp) X(c_beqz) X(c_bnez)
+
+#define DECLARE_INSN_FUNC(name) extern reg_t fast_rv64i_##name(processor_t*, insn_t, reg_t);
+UOP_INSNS(DECLARE_INSN_FUNC)
+#undef DECLARE_INSN_FUNC
+
+static uop_t uop(uop_opcode_t op, reg_t rd, reg_t rs1, reg_t rs2, int64_t imm)
+{
+  return {op, uint8_t(rd), uint8_t(rs1), uint8_t(rs2), 1, op, imm};
+}
+
+static uop_t r_type(uop_opcode_t op, reg_t rd, reg_t rs1, reg_t rs2)
+{
+  return uop(op, rd, rs1, rs2, 0);
+}
+
+static uop_t i_type(uop_opcode_t op, reg_t rd, reg_t rs1, int64_t imm)
+{
+  return uop(op, rd, rs1, 0, imm);
+}
+
+static uop_t s_type(uop_opcode_t op, reg_t rs1, reg_t rs2, int64_t imm)
+{
+  return uop(op, 0, rs1, rs2, imm);
+}
+
+uop_t decode_uop(processor_t* p, const insn_fetch_t& fetch, reg_t pc)
+{
+  insn_func_t f = fetch.func;
+  insn_t insn = fetch.insn;
+  const uop_t none = {};
+
+  // misa writes flush the icache, so the extension checks the handlers
+  // make on every execution can be made once here instead
+  if (insn.length() == 2 && !p->extension_enabled(EXT_ZCA))
+    return none;
+
+  // the major opcode (funct3 and quadrant for RVC) narrows down which
+  // handlers to compare against, which keeps icache refills cheap
+  #define IS(name) (f == fast_rv64i_##name)
+  switch (insn.length() == 2 ? insn.bits() & 0xe003 : insn.bits() & 0x7f) {
+    case 0x13: // OP-IMM
+      if (IS(addi)) return i_type(UOP_ADDI, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(slti)) return i_type(UOP_SLTI, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(sltiu)) return i_type(UOP_SLTIU, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(xori)) return i_type(UOP_XORI, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(ori)) return i_type(UOP_ORI, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(andi)) return i_type(UOP_ANDI, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(slli)) return i_type(UOP_SLLI, insn.rd(), insn.rs1(), insn.shamt());
+      if (IS(srli)) return i_type(UOP_SRLI, insn.rd(), insn.rs1(), insn.shamt());
+      if (IS(srai)) return i_type(UOP_SRAI, insn.rd(), insn.rs1(), insn.shamt());
+      break;
+    case 0x1b: // OP-IMM-32
+      if (IS(addiw)) return i_type(UOP_ADDIW, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(slliw)) return i_type(UOP_SLLIW, insn.rd(), insn.rs1(), insn.shamt());
+      if (IS(srliw)) return i_type(UOP_SRLIW, insn.rd(), insn.rs1(), insn.shamt());
+      if (IS(sraiw)) return i_type(UOP_SRAIW, insn.rd(), insn.rs1(), insn.shamt());
+      break;
+    case 0x33: // OP
+      if (IS(add)) return r_type(UOP_ADD, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(sub)) return r_type(UOP_SUB, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(sll)) return r_type(UOP_SLL, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(slt)) return r_type(UOP_SLT, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(sltu)) return r_type(UOP_SLTU, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(xor)) return r_type(UOP_XOR, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(srl)) return r_type(UOP_SRL, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(sra)) return r_type(UOP_SRA, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(or)) return r_type(UOP_OR, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(and)) return r_type(UOP_AND, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(mul) && (p->extension_enabled('M') || p->extension_enabled(EXT_ZMMUL)))
+        return r_type(UOP_MUL, insn.rd(), insn.rs1(), insn.rs2());
+      break;
+    case 0x3b: // OP-32
+      if (IS(addw)) return r_type(UOP_ADDW, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(subw)) return r_type(UOP_SUBW, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(sllw)) return r_type(UOP_SLLW, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(srlw)) return r_type(UOP_SRLW, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(sraw)) return r_type(UOP_SRAW, insn.rd(), insn.rs1(), insn.rs2());
+      if (IS(mulw) && (p->extension_enabled('M') || p->extension_enabled(EXT_ZMMUL)))
+        return r_type(UOP_MULW, insn.rd(), insn.rs1(), insn.rs2());
+      break;
+    case 0x37: // LUI
+      if (IS(lui)) return i_type(UOP_LI, insn.rd(), 0, insn.u_imm());
+      break;
+    case 0x17: // AUIPC
+      if (IS(auipc)) return i_type(UOP_LI, insn.rd(), 0, insn.u_imm() + pc);
+      break;
+    case 0x03: // LOAD
+      if (IS(lb)) return i_type(UOP_LB, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(lh)) return i_type(UOP_LH, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(lw)) return i_type(UOP_LW, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(ld)) return i_type(UOP_LD, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(lbu)) return i_type(UOP_LBU, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(lhu)) return i_type(UOP_LHU, insn.rd(), insn.rs1(), insn.i_imm());
+      if (IS(lwu)) return i_type(UOP_LWU, insn.rd(), insn.rs1(), insn.i_imm());
+      break;
+    case 0x23: // STORE
+      if (IS(sb)) return s_type(UOP_SB, insn.rs1(), insn.rs2(), insn.s_imm());
+      if (IS(sh)) return s_type(UOP_SH, insn.rs1(), insn.rs2(), insn.s_imm());
+      if (IS(sw)) return s_type(UOP_SW, insn.rs1(), insn.rs2(), insn.s_imm());
+      if (IS(sd)) return s_type(UOP_SD, insn.rs1(), insn.rs2(), insn.s_imm());
+      break;
+    case 0x63: // BRANCH
+      if (IS(beq)) return s_type(UOP_BEQ, insn.rs1(), insn.rs2(), pc + insn.sb_imm());
+      if (IS(bne)) return s_type(UOP_BNE, insn.rs1(), insn.rs2(), pc + insn.sb_imm());
+      if (IS(blt)) return s_type(UOP_BLT, insn.rs1(), insn.rs2(), pc + insn.sb_imm());
+      if (IS(bge)) return s_type(UOP_BGE, insn.rs1(), insn.rs2(), pc + insn.sb_imm());
+      if (IS(bltu)) return s_type(UOP_BLTU, insn.rs1(), insn.rs2(), pc + insn.sb_imm());
+      if (IS(bgeu)) return s_type(UOP_BGEU, insn.rs1(), insn.rs2(), pc + insn.sb_imm());
+      break;
+
+    case 0x0000:
+      if (IS(c_addi4spn) && insn.rvc_addi4spn_imm() != 0)
+        return i_type(UOP_ADDI, insn.rvc_rs2s(), X_SP, insn.rvc_addi4spn_imm());
+      break;
+    case 0x4000:
+      if (IS(c_lw)) return i_type(UOP_LW, insn.rvc_rs2s(), insn.rvc_rs1s(), insn.rvc_lw_imm());
+      break;
+    case 0x6000:
+      if (IS(c_ld)) return i_type(UOP_LD, insn.rvc_rs2s(), insn.rvc_rs1s(), insn.rvc_ld_imm());
+      break;
+    case 0xc000:
+      if (IS(c_sw)) return s_type(UOP_SW, insn.rvc_rs1s(), insn.rvc_rs2s(), insn.rvc_lw_imm());
+      break;
+    case 0xe000:
+      if (IS(c_sd)) return s_type(UOP_SD, insn.rvc_rs1s(), insn.rvc_rs2s(), insn.rvc_ld_imm());
+      break;
+    case 0x0001:
+      if (IS(c_addi)) return i_type(UOP_ADDI, insn.rvc_rd(), insn.rvc_rd(), insn.rvc_imm());
+      break;
+    case 0x2001:
+      if (IS(c_jal) && insn.rvc_rd() != 0) // c.addiw
+        return i_type(UOP_ADDIW, insn.rvc_rd(), insn.rvc_rd(), insn.rvc_imm());
+      break;
+    case 0x4001:
+      if (IS(c_li)) return i_type(UOP_LI, insn.rvc_rd(), 0, insn.rvc_imm());
+      break;
+    case 0x6001:
+      if (IS(c_lui) && insn.rvc_rd() == 2 && insn.rvc_addi16sp_imm() != 0)
+        return i_type(UOP_ADDI, X_SP, X_SP, insn.rvc_addi16sp_imm());
+      if (IS(c_lui) && insn.rvc_rd() != 2 && insn.rvc_imm() != 0)
+        return i_type(UOP_LI, insn.rvc_rd(), 0, insn.rvc_imm() << 12);
+      break;
+    case 0x8001:
+      if (IS(c_sub)) return r_type(UOP_SUB, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s());
+      if (IS(c_xor)) return r_type(UOP_XOR, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s());
+      if (IS(c_or)) return r_type(UOP_OR, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s());
+      if (IS(c_and)) return r_type(UOP_AND, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s());
+      if (IS(c_addw)) return r_type(UOP_ADDW, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s());
+      if (IS(c_subw)) return r_type(UOP_SUBW, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_rs2s());
+      if (IS(c_andi)) return i_type(UOP_ANDI, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_imm());
+      if (IS(c_srli)) return i_type(UOP_SRLI, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_zimm());
+      if (IS(c_srai)) return i_type(UOP_SRAI, insn.rvc_rs1s(), insn.rvc_rs1s(), insn.rvc_zimm());
+      break;
+    case 0xc001:
+      if (IS(c_beqz)) return s_type(UOP_BEQ, insn.rvc_rs1s(), 0, pc + insn.rvc_b_imm());
+      break;
+    case 0xe001:
+      if (IS(c_bnez)) return s_type(UOP_BNE, insn.rvc_rs1s(), 0, pc + insn.rvc_b_imm());
+      break;
+    case 0x0002:
+      if (IS(c_slli)) return i_type(UOP_SLLI, insn.rvc_rd(), insn.rvc_rd(), insn.rvc_zimm());
+      break;
+    case 0x4002:
+      if (IS(c_lwsp) && insn.rvc_rd() != 0) return i_type(UOP_LW, insn.rvc_rd(), X_SP, insn.rvc_lwsp_imm());
+      break;
+    case 0x6002:
+      if (IS(c_ldsp) && insn.rvc_rd() != 0) return i_type(UOP_LD, insn.rvc_rd(), X_SP, insn.rvc_ldsp_imm());
+      break;
+    case 0x8002:
+      if (IS(c_mv) && insn.rvc_rs2() != 0) return r_type(UOP_ADD, insn.rvc_rd(), 0, insn.rvc_rs2());
+      if (IS(c_add) && insn.rvc_rs2() != 0) return r_type(UOP_ADD, insn.rvc_rd(), insn.rvc_rs1(), insn.rvc_rs2());
+      break;
+    case 0xc002:
+      if (IS(c_swsp)) return s_type(UOP_SW, X_SP, insn.rvc_rs2(), insn.rvc_swsp_imm());
+      break;
+    case 0xe002:
+      if (IS(c_sdsp)) return s_type(UOP_SD, X_SP, insn.rvc_rs2(), insn.rvc_sdsp_imm());
+      break;
+  }
+  #undef IS
+
+  return none;
+}
+
+bool fuse_uop(uop_t& first, const uop_t& next)
+{
+  // every idiom hands its result to the next instruction through rd
+  if (first.rd == 0 || next.rs1 != first.rd)
+    return false;
+
+  bool same_rd = next.rd == first.rd;
+  bool test_zero = (next.op == UOP_BEQ || next.op == UOP_BNE) && next.rs2 == 0;
+  uop_opcode_t fused = UOP_NONE;
+
+  switch (first.op) {
+    case UOP_LI:
+      if (next.op == UOP_ADDI && same_rd) fused = UOP_LI_ADDI;
+      if (next.op == UOP_ADDIW && same_rd) fused = UOP_LI_ADDIW;
+      if (next.op == UOP_LW) fused = UOP_LI_LW;
+      if (next.op == UOP_LD) fused = UOP_LI_LD;
+      break;
+    case UOP_SLLI:
+      if (next.op == UOP_SRLI && same_rd) fused = UOP_SLLI_SRLI;
+      if (next.op == UOP_SRAI && same_rd) fused = UOP_SLLI_SRAI;
+      break;
+    case UOP_SLT: if (test_zero) fused = UOP_SLT_BRANCH; break;
+    case UOP_SLTU: if (test_zero) fused = UOP_SLTU_BRANCH; break;
+    case UOP_SLTI: if (test_zero) fused = UOP_SLTI_BRANCH; break;
+    case UOP_SLTIU: if (test_zero) fused = UOP_SLTIU_BRANCH; break;
+    default: break;
+  }
+
+  if (fused == UOP_NONE)
+    return false;
+  first.exec = fused;
+  return true;
+}
@@ -0,0 +1,59 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_UOP_H
+#define _RISCV_UOP_H
+
+#include "decode.h"
+#include <cstdint>
+
+class processor_t;
+struct insn_fetch_t;
+
+// The common RV64 integer instructions, with their operands unpacked.
+// They are pre-decoded at icache refill so that the fast path can execute
+// them inline, without re-extracting fields or calling their insn_func_t.
+enum uop_opcode_t : uint8_t {
+  UOP_NONE, // not pre-decoded; call the handler
+
+  UOP_ADD, UOP_SUB, UOP_SLL, UOP_SLT, UOP_SLTU,
+  UOP_XOR, UOP_SRL, UOP_SRA, UOP_OR, UOP_AND, UOP_MUL,
+  UOP_ADDW, UOP_SUBW, UOP_SLLW, UOP_SRLW, UOP_SRAW, UOP_MULW,
+
+  UOP_ADDI, UOP_SLTI, UOP_SLTIU, UOP_XORI, UOP_ORI, UOP_ANDI,
+  UOP_SLLI, UOP_SRLI, UOP_SRAI,
+  UOP_ADDIW, UOP_SLLIW, UOP_SRLIW, UOP_SRAIW,
+
+  UOP_LI, // rd = imm
+
+  UOP_LB, UOP_LH, UOP_LW, UOP_LD, UOP_LBU, UOP_LHU, UOP_LWU,
+  UOP_SB, UOP_SH, UOP_SW, UOP_SD,
+
+  UOP_BEQ, UOP_BNE, UOP_BLT, UOP_BGE, UOP_BLTU, UOP_BGEU, // imm is the target
+
+  // fused forms of an entry and the one after it, set by fuse_uop
+  UOP_LI_ADDI, UOP_LI_ADDIW, // lui/auipc + addi(w) of the same register
+  UOP_LI_LW, UOP_LI_LD, // auipc + load through its result
+  UOP_SLLI_SRLI, UOP_SLLI_SRAI, // zero/sign extension by a shift pair
+  UOP_SLT_BRANCH, UOP_SLTU_BRANCH, UOP_SLTI_BRANCH, UOP_SLTIU_BRANCH, // + beqz/bnez
+};
+
+struct uop_t {
+  uop_opcode_t op;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t run; // pre-decoded entries from here on, counted at icache refill
+  uop_opcode_t exec; // what the fast path runs: op, or a fused form
+  int64_t imm; // sign-extended immediate, shift amount, or branch target
+};
+
+// Returns UOP_NONE for anything left to the handler, including encodings
+// whose handler would raise an illegal-instruction trap.
+uop_t decode_uop(processor_t* p, const insn_fetch_t& fetch, reg_t pc);
+
+// If `first` and `next` form an idiom with a fused form, points first.exec
+// at it and returns true.  Both keep their own decoding, so the pair can
+// still be run, or trap, one instruction at a time.
+bool fuse_uop(uop_t& first, const uop_t& next);
+
+#endif
@@ -4,6 +4,7 @@
 #include "vector_unit.h"
 #include "processor.h"
 #include "arith.h"
+#include "checkpoint.h"
 
 void vectorUnit_t::vectorUnit_t::reset()
 {
@@ -27,6 +28,22 @@ void vectorUnit_t::vectorUnit_t::reset()
   set_vl(0, 0, 0, -1); // default to illegal configuration
 }
 
+// the vector CSRs are saved with the rest; this is what set_vl() derives
+// from them
+void vectorUnit_t::checkpoint(checkpoint_t& c)
+{
+  c.expect(vlenb, "vector register length");
+  c.bytes(reg_file, NVPR * vlenb);
+  c.io(setvl_count);
+  c.io(vlmax);
+  c.io(vma);
+  c.io(vta);
+  c.io(vsew);
+  c.io(vflmul);
+  c.io(vill);
+  c.io(vstart_alu);
+}
+
 reg_t vectorUnit_t::vectorUnit_t::set_vl(int rd, int rs1, reg_t reqVL, reg_t newType)
 {
   int new_vlmul = 0;
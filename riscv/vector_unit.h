@@ -111,6 +111,7 @@ public:
 public:
 
   void reset();
+  void checkpoint(checkpoint_t& c);
 
   vectorUnit_t():
     p(0),
@@ -4,11 +4,14 @@
 #include "cfg.h"
 #include "sim.h"
 #include "mmu.h"
+#include "dbt.h"
 #include "arith.h"
 #include "remote_bitbang.h"
 #include "cachesim.h"
 #include "extension.h"
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <fesvr/option_parser.h>
 #include <stdexcept>
 #include <stdio.h>
@@ -19,6 +22,7 @@
 #include <fstream>
 #include <limits>
 #include <cinttypes>
+#include <cstring>
 #include <sstream>
 #include "../VERSION"
 
@@ -31,9 +35,24 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  -m<n>                 Provide <n> MiB of target memory [default 2048]\n");
   fprintf(stderr, "  -m<a:m,b:n,...>       Provide memory regions of size m and n bytes\n");
   fprintf(stderr, "                          at base addresses a and b (with 4 KiB alignment)\n");
+  fprintf(stderr, "  --flat-mem            Reserve each memory region as one host mapping, populated\n");
+  fprintf(stderr, "                          as it is touched, instead of page by page\n");
+  fprintf(stderr, "  --thp                 Like --flat-mem, backed by transparent hugepages where\n");
+  fprintf(stderr, "                          the host supports them\n");
   fprintf(stderr, "  -d                    Interactive debug mode\n");
   fprintf(stderr, "  -g                    Track histogram of PCs\n");
   fprintf(stderr, "  -l                    Generate a log of execution\n");
+  fprintf(stderr, "  --dbt                 Translate hot integer code to host code (x86-64 only)\n");
+  fprintf(stderr, "  --profile=<n>         Sample each processor's call stack every n instructions,\n");
+  fprintf(stderr, "                          and print a profile and folded stacks at exit\n");
+  fprintf(stderr, "  --bbv=<n>             Write each processor's basic-block vectors for SimPoint\n");
+  fprintf(stderr, "                          every n instructions, to <file>.<hartid>.bb\n");
+  fprintf(stderr, "  --bbv-file=<file>     File name prefix for --bbv [default spike]\n");
+  fprintf(stderr, "  --parallel            Run each processor on its own host thread\n");
+  fprintf(stderr, "  --skip-idle           Jump simulated time ahead to the next timer interrupt\n");
+  fprintf(stderr, "                          when every processor is waiting for one\n");
+  fprintf(stderr, "  --quantum=<n>         Instructions each processor runs between\n");
+  fprintf(stderr, "                          synchronisations with --parallel [default 5000]\n");
 #ifdef HAVE_BOOST_ASIO
   fprintf(stderr, "  -s                    Command I/O via socket (use with -d)\n");
 #endif
@@ -66,6 +85,8 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  --disable-dtb         Don't write the device tree blob into memory\n");
   fprintf(stderr, "  --kernel=<path>       Load kernel flat image into memory\n");
   fprintf(stderr, "  --initrd=<path>       Load kernel initrd into memory\n");
+  fprintf(stderr, "                          (with --flat-mem, --kernel and --initrd are mapped\n");
+  fprintf(stderr, "                          in copy-on-write, not copied)\n");
   fprintf(stderr, "  --bootargs=<args>     Provide custom bootargs for kernel [default: %s]\n",
           DEFAULT_KERNEL_BOOTARGS);
   fprintf(stderr, "  --real-time-clint     Increment clint time at real-time rate\n");
@@ -85,6 +106,22 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  --dm-no-impebreak     Debug module won't support implicit ebreak in program buffer\n");
   fprintf(stderr, "  --blocksz=<size>      Cache block size (B) for CMO operations(powers of 2) [default 64]\n");
   fprintf(stderr, "  --instructions=<n>    Stop after n instructions\n");
+  fprintf(stderr, "  --save-checkpoint=<file>@<n>\n");
+  fprintf(stderr, "                        Save the machine's state to <file> after n instructions\n");
+  fprintf(stderr, "  --checkpoint-every=<n> After --save-checkpoint, save again every n instructions,\n");
+  fprintf(stderr, "                          to <file>.1, <file>.2, ...; each holds only the memory\n");
+  fprintf(stderr, "                          written since the one before, and restoring it restores\n");
+  fprintf(stderr, "                          those first\n");
+  fprintf(stderr, "  --restore-checkpoint=<file>\n");
+  fprintf(stderr, "                        Resume from a saved state instead of loading a program;\n");
+  fprintf(stderr, "                          run with the same options that saved it\n");
+  fprintf(stderr, "  --fork-at=<file>@<n>  After n instructions, fork a copy of the simulator per\n");
+  fprintf(stderr, "                          --fork-variant, which carries on from there with its\n");
+  fprintf(stderr, "                          output going to <file>.1, <file>.2, ...\n");
+  fprintf(stderr, "  --fork-variant=<opts> What a fork changes, from --ic, --dc and --l2 (which start\n");
+  fprintf(stderr, "                          cold), --instructions=<n> (counted from the fork) and\n");
+  fprintf(stderr, "                          --stdin=<file>, e.g. \"--dc=64:8:64 --l2=512:8:64\"\n");
+  fprintf(stderr, "                          This flag can be used multiple times.\n");
 
   exit(exit_code);
 }
@@ -110,6 +147,11 @@ static std::ifstream::pos_type get_file_size(const char *filename)
 static void read_file_bytes(const char *filename,size_t fileoff,
                             abstract_mem_t* mem, size_t memoff, size_t read_sz)
 {
+  // a flat memory can map the file in place rather than copying it
+  if (auto flat = dynamic_cast<flat_mem_t*>(mem))
+    if (flat->map_file(filename, fileoff, memoff, read_sz))
+      return;
+
   std::ifstream in(filename, std::ios::in | std::ios::binary);
   in.seekg(fileoff, std::ios::beg);
 
@@ -254,12 +296,18 @@ static std::vector<mem_cfg_t> parse_mem_layout(const char* arg)
   return merged_mem;
 }
 
-static std::vector<std::pair<reg_t, abstract_mem_t*>> make_mems(const std::vector<mem_cfg_t> &layout)
+static std::vector<std::pair<reg_t, abstract_mem_t*>> make_mems(const std::vector<mem_cfg_t> &layout,
+                                                                 bool flat_mem, bool thp)
 {
   std::vector<std::pair<reg_t, abstract_mem_t*>> mems;
   mems.reserve(layout.size());
   for (const auto &cfg : layout) {
-    mems.push_back(std::make_pair(cfg.get_base(), new mem_t(cfg.get_size())));
+    abstract_mem_t* mem;
+    if (flat_mem)
+      mem = new flat_mem_t(cfg.get_size(), thp);
+    else
+      mem = new mem_t(cfg.get_size());
+    mems.push_back(std::make_pair(cfg.get_base(), mem));
   }
   return mems;
 }
@@ -281,6 +329,23 @@ static unsigned long atoul_nonzero_safe(const char* s)
   return res;
 }
 
+// Split a --fork-variant into its options and their values
+static std::vector<std::pair<std::string, std::string>> parse_fork_variant(const std::string& variant)
+{
+  std::vector<std::pair<std::string, std::string>> opts;
+  std::istringstream in(variant);
+  for (std::string opt; in >> opt; ) {
+    size_t eq = opt.find('=');
+    std::string name = opt.substr(0, eq);
+    if (eq == std::string::npos ||
+        (name != "--ic" && name != "--dc" && name != "--l2" &&
+         name != "--instructions" && name != "--stdin"))
+      throw std::invalid_argument("unrecognized fork variant option " + opt);
+    opts.emplace_back(name, opt.substr(eq + 1));
+  }
+  return opts;
+}
+
 static std::vector<size_t> parse_hartids(const char *s)
 {
   std::string const str(s);
@@ -319,6 +384,15 @@ int main(int argc, char** argv)
   bool debug = false;
   bool halted = false;
   bool histogram = false;
+  bool dbt = false;
+  bool parallel = false;
+  bool skip_idle = false;
+  bool flat_mem = false;
+  bool thp = false;
+  size_t quantum = sim_t::INTERLEAVE;
+  size_t profile_period = 0;
+  size_t bbv_interval = 0;
+  const char* bbv_file = "spike";
   bool log = false;
   bool UNUSED socket = false;  // command line option -s
   bool dump_dts = false;
@@ -340,6 +414,13 @@ int main(int argc, char** argv)
   unsigned dmi_rti = 0;
   reg_t blocksz = 64;
   std::optional<unsigned long long> instructions;
+  std::string save_checkpoint;
+  unsigned long long save_checkpoint_after = 0;
+  unsigned long long checkpoint_every = 0;
+  const char* restore_checkpoint = NULL;
+  std::string fork_at;
+  unsigned long long fork_after = 0;
+  std::vector<std::string> fork_variants;
   debug_module_config_t dm_config;
   cfg_arg_t<size_t> nprocs(1);
 
@@ -377,6 +458,8 @@ int main(int argc, char** argv)
 #endif
   parser.option('p', 0, 1, [&](const char* s){nprocs = atoul_nonzero_safe(s);});
   parser.option('m', 0, 1, [&](const char* s){cfg.mem_layout = parse_mem_layout(s);});
+  parser.option(0, "flat-mem", 0, [&](const char UNUSED *s){flat_mem = true;});
+  parser.option(0, "thp", 0, [&](const char UNUSED *s){flat_mem = thp = true;});
   parser.option(0, "halted", 0, [&](const char UNUSED *s){halted = true;});
   parser.option(0, "rbb-port", 1, [&](const char* s){use_rbb = true; rbb_port = atoul_safe(s);});
   parser.option(0, "pc", 1, [&](const char* s){cfg.start_pc = strtoull(s, 0, 0);});
@@ -431,6 +514,19 @@ int main(int argc, char** argv)
       [&](const char UNUSED *s){dm_config.support_abstract_fpr_access = false;});
   parser.option(0, "dm-no-halt-groups", 0,
       [&](const char UNUSED *s){dm_config.support_haltgroups = false;});
+  parser.option(0, "dbt", 0, [&](const char UNUSED *s){
+    if (!dbt_t::supported()) {
+      fprintf(stderr, "--dbt is not supported on this host\n");
+      exit(-1);
+    }
+    dbt = true;
+  });
+  parser.option(0, "parallel", 0, [&](const char UNUSED *s){parallel = true;});
+  parser.option(0, "skip-idle", 0, [&](const char UNUSED *s){skip_idle = true;});
+  parser.option(0, "quantum", 1, [&](const char* s){quantum = atoul_nonzero_safe(s);});
+  parser.option(0, "profile", 1, [&](const char* s){profile_period = atoul_nonzero_safe(s);});
+  parser.option(0, "bbv", 1, [&](const char* s){bbv_interval = atoul_nonzero_safe(s);});
+  parser.option(0, "bbv-file", 1, [&](const char* s){bbv_file = s;});
   parser.option(0, "log-commits", 0,
                 [&](const char UNUSED *s){log_commits = true;});
   parser.option(0, "log", 1,
@@ -455,15 +551,75 @@ int main(int argc, char** argv)
   parser.option(0, "instructions", 1, [&](const char* s){
     instructions = strtoull(s, 0, 0);
   });
+  parser.option(0, "save-checkpoint", 1, [&](const char* s){
+    const char* at = strrchr(s, '@');
+    if (!at || at == s) {
+      fprintf(stderr, "--save-checkpoint expects <file>@<n>\n");
+      exit(-1);
+    }
+    save_checkpoint.assign(s, at);
+    save_checkpoint_after = strtoull(at + 1, 0, 0);
+  });
+  parser.option(0, "checkpoint-every", 1, [&](const char* s){
+    checkpoint_every = strtoull(s, 0, 0);
+  });
+  parser.option(0, "restore-checkpoint", 1, [&](const char* s){restore_checkpoint = s;});
+  parser.option(0, "fork-at", 1, [&](const char* s){
+    const char* at = strrchr(s, '@');
+    if (!at || at == s) {
+      fprintf(stderr, "--fork-at expects <file>@<n>\n");
+      exit(-1);
+    }
+    fork_at.assign(s, at);
+    fork_after = strtoull(at + 1, 0, 0);
+  });
+  parser.option(0, "fork-variant", 1, [&](const char* s){
+    try {
+      parse_fork_variant(s);
+    } catch (std::invalid_argument& e) {
+      fprintf(stderr, "%s\n", e.what());
+      exit(-1);
+    }
+    fork_variants.push_back(s);
+  });
 
   auto argv1 = parser.parse(argv);
   std::vector<std::string> htif_args(argv1, (const char*const*)argv + argc);
 
-  if (!*argv1)
-    help();
+  if (!*argv1) {
+    if (!restore_checkpoint)
+      help();
+    // the restored machine's memory holds its program; htif loads none
+    htif_args.push_back("none");
+  }
+
+  if (parallel && (log || log_commits || ic || dc || l2)) {
+    fprintf(stderr, "--parallel cannot be combined with -l, --log-commits, --ic, --dc or --l2\n");
+    exit(1);
+  }
+
+  if (checkpoint_every && save_checkpoint.empty()) {
+    fprintf(stderr, "--checkpoint-every requires --save-checkpoint\n");
+    exit(1);
+  }
+
+  if (parallel && !save_checkpoint.empty()) {
+    fprintf(stderr, "--parallel cannot be combined with --save-checkpoint\n");
+    exit(1);
+  }
+
+  if (fork_at.empty() != fork_variants.empty()) {
+    fprintf(stderr, "--fork-at and --fork-variant must be used together\n");
+    exit(1);
+  }
+
+  if (parallel && !fork_at.empty()) {
+    fprintf(stderr, "--parallel cannot be combined with --fork-at\n");
+    exit(1);
+  }
 
   std::vector<std::pair<reg_t, abstract_mem_t*>> mems =
-      make_mems(cfg.mem_layout);
+      make_mems(cfg.mem_layout, flat_mem, thp);
 
   if (kernel && check_file_exists(kernel)) {
     const char *isa = cfg.isa;
@@ -484,8 +640,9 @@ int main(int argc, char** argv)
     size_t initrd_size = get_file_size(initrd);
     for (auto& m : mems) {
       if (initrd_size && (initrd_size + 0x1000) < m.second->size()) {
-         reg_t initrd_end = m.first + m.second->size() - 0x1000;
-         reg_t initrd_start = initrd_end - initrd_size;
+         // page-aligned, so that it can be mapped in
+         reg_t initrd_start = (m.first + m.second->size() - 0x1000 - initrd_size) & ~reg_t(0xfff);
+         reg_t initrd_end = initrd_start + initrd_size;
          cfg.initrd_bounds = std::make_pair(initrd_start, initrd_end);
          read_file_bytes(initrd, 0, m.second, initrd_start - m.first, initrd_size);
          break;
@@ -517,7 +674,8 @@ int main(int argc, char** argv)
       mems, plugin_device_factories, htif_args, dm_config, log_path, dtb_enabled, dtb_file,
       socket,
       cmd_file,
-      instructions);
+      instructions,
+      restore_checkpoint);
   std::unique_ptr<remote_bitbang_t> remote_bitbang((remote_bitbang_t *) NULL);
   std::unique_ptr<jtag_dtm_t> jtag_dtm(
       new jtag_dtm_t(&s.debug_module, dmi_rti));
@@ -531,14 +689,19 @@ int main(int argc, char** argv)
     return 0;
   }
 
-  if (ic && l2) ic->set_miss_handler(&*l2);
-  if (dc && l2) dc->set_miss_handler(&*l2);
-  if (ic) ic->set_log(log_cache);
-  if (dc) dc->set_log(log_cache);
+  auto attach_caches = [&](){
+    if (ic && l2) ic->set_miss_handler(&*l2);
+    if (dc && l2) dc->set_miss_handler(&*l2);
+    if (ic) ic->set_log(log_cache);
+    if (dc) dc->set_log(log_cache);
+    for (size_t i = 0; i < cfg.nprocs(); i++) {
+      if (ic) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
+      if (dc) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
+    }
+  };
+  attach_caches();
   for (size_t i = 0; i < cfg.nprocs(); i++)
   {
-    if (ic) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
-    if (dc) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
     for (auto e : extensions)
       s.get_core(i)->register_extension(e());
     s.get_core(i)->get_mmu()->set_cache_blocksz(blocksz);
@@ -547,6 +710,63 @@ int main(int argc, char** argv)
   s.set_debug(debug);
   s.configure_log(log, log_commits);
   s.set_histogram(histogram);
+  s.set_dbt(dbt);
+  s.set_profile(profile_period);
+  if (bbv_interval)
+    s.set_bbv(bbv_file, bbv_interval);
+  if (parallel)
+    s.set_parallel(quantum);
+  s.set_skip_idle(skip_idle);
+  if (!save_checkpoint.empty())
+    s.save_checkpoint_at(save_checkpoint.c_str(), save_checkpoint_after, checkpoint_every);
+  if (!fork_at.empty())
+    s.fork_at(fork_at.c_str(), fork_after, fork_variants);
+  s.set_fork_handler([&](const std::string& variant){
+    std::vector<std::pair<std::string, std::string>> opts;
+    try {
+      opts = parse_fork_variant(variant);
+    } catch (std::invalid_argument& e) {
+      fprintf(stderr, "%s\n", e.what());
+      exit(1);
+    }
+
+    bool new_caches = false;
+    for (auto& [name, value] : opts)
+      new_caches |= name == "--ic" || name == "--dc" || name == "--l2";
+    if (new_caches) {
+      for (size_t i = 0; i < cfg.nprocs(); i++) {
+        if (ic) s.get_core(i)->get_mmu()->unregister_memtracer(&*ic);
+        if (dc) s.get_core(i)->get_mmu()->unregister_memtracer(&*dc);
+      }
+    }
+
+    // the caches a fork replaces are dropped without printing their stats,
+    // which the parent prints
+    for (auto& [name, value] : opts) {
+      if (name == "--ic") {
+        ic.release();
+        ic.reset(new icache_sim_t(value.c_str()));
+      } else if (name == "--dc") {
+        dc.release();
+        dc.reset(new dcache_sim_t(value.c_str()));
+      } else if (name == "--l2") {
+        l2.release();
+        l2.reset(cache_sim_t::construct(value.c_str(), "L2$"));
+      } else if (name == "--instructions") {
+        s.set_instruction_limit(strtoull(value.c_str(), 0, 0));
+      } else if (name == "--stdin") {
+        int fd = open(value.c_str(), O_RDONLY);
+        if (fd < 0) {
+          fprintf(stderr, "could not open %s: %s\n", value.c_str(), strerror(errno));
+          exit(1);
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+      }
+    }
+    if (new_caches)
+      attach_caches();
+  });
 
   auto return_code = s.run();
 